@@ -0,0 +1,434 @@
+/**
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+// YCSB style benchmark. Loads --record_count records, then runs the mix of a
+// workload from --threads threads and prints throughput and latency
+// percentiles per operation as JSON.
+//
+//   bitcask_bench --workload=a --record_count=1000000 --threads=8
+#include <gflags/gflags.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitcask.hpp>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "stats.hpp"
+
+using namespace std;
+using namespace bitcask;
+
+DEFINE_string(dir, "/tmp/bitcask_bench", "Directory of the store, wiped before the run.");
+DEFINE_bool(wipe, false, "Wipe --dir even when it holds files that are not a bitcask store.");
+DEFINE_string(workload, "a", "YCSB workload, a to f. Sets the operation mix and the key distribution.");
+DEFINE_string(distribution, "", "Key distribution, uniform, zipfian or latest. Defaults to the workload's.");
+DEFINE_double(zipfian_theta, 0.99, "Skew of the zipfian and latest distributions.");
+DEFINE_uint64(record_count, 100000, "Records loaded before the run.");
+DEFINE_uint64(operation_count, 100000, "Operations run by each thread.");
+DEFINE_uint64(threads, 4, "Threads running the workload mix.");
+DEFINE_uint64(writer_threads, 0, "Extra threads that only update while the workload runs.");
+DEFINE_uint64(value_size, 100, "Value size in bytes, the smallest one with --value_size_max.");
+DEFINE_uint64(value_size_max, 0, "Values are uniformly sized up to this when it is above --value_size.");
+DEFINE_uint64(max_scan_length, 100, "Longest scan of workload e.");
+DEFINE_string(output, "", "Also write the JSON report to this file.");
+
+// Store parameters.
+DEFINE_uint64(max_data_file_size, Params{}.max_data_file_size, "Params::max_data_file_size");
+DEFINE_uint64(compaction_interval_secs, 0, "Run compaction in the background this often, 0 disables it.");
+DEFINE_uint64(flush_batch_size, Params{}.flush_batch_size, "Params::flush_batch_size");
+DEFINE_uint64(flush_interval_usecs, Params{}.flush_interval_usecs, "Params::flush_interval_usecs");
+DEFINE_uint64(write_lanes, Params{}.write_lanes, "Params::write_lanes");
+DEFINE_uint64(value_cache_bytes, Params{}.value_cache_bytes, "Params::value_cache_bytes");
+DEFINE_bool(mmap_reads, Params{}.mmap_reads, "Params::mmap_reads");
+DEFINE_bool(fsync, Params{}.fsync_mode, "Params::fsync_mode");
+DEFINE_bool(verify_checksums, Params{}.verify_checksums, "Params::verify_checksums");
+DEFINE_string(compression, "none", "Value compression, none, lz4, zstd or zstd_dict.");
+
+namespace {
+
+enum Op { kRead, kUpdate, kInsert, kScan, kReadModifyWrite, kWriterUpdate, kNumOps };
+const char* kOpNames[kNumOps] = {"read", "update", "insert", "scan", "read_modify_write", "writer_update"};
+
+// Proportions of the operations in a workload, and its key distribution.
+struct Workload {
+    array<double, kReadModifyWrite + 1> mix;
+    string distribution;
+};
+
+const map<string, Workload> kWorkloads = {
+    {"a", {{0.5, 0.5, 0, 0, 0}, "zipfian"}},  // update heavy
+    {"b", {{0.95, 0.05, 0, 0, 0}, "zipfian"}},  // read mostly
+    {"c", {{1, 0, 0, 0, 0}, "zipfian"}},  // read only
+    {"d", {{0.95, 0, 0.05, 0, 0}, "latest"}},  // read latest
+    {"e", {{0, 0, 0.05, 0.95, 0}, "zipfian"}},  // short ranges
+    {"f", {{0.5, 0, 0, 0, 0.5}, "zipfian"}},  // read-modify-write
+};
+
+uint64_t fnv64(uint64_t value) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (int i = 0; i < 8; i++) {
+        hash = (hash ^ (value & 0xff)) * 0x100000001b3;
+        value >>= 8;
+    }
+    return hash;
+}
+
+// Keys are hashed so that neighbouring records are not neighbouring keys.
+string key_of(uint64_t index) { return format("user{:020}", fnv64(index)); }
+
+// Inserts complete out of order. Reads only pick records below the first
+// insert still in flight, so they never miss a key that is not written yet.
+class AckedInserts {
+   public:
+    explicit AckedInserts(uint64_t count) : count_(count) {}
+
+    uint64_t count() const { return count_.load(memory_order_acquire); }
+
+    void ack(uint64_t index) {
+        lock_guard lock(mutex_);
+        acked_.insert(index);
+        auto count = count_.load(memory_order_relaxed);
+        while (!acked_.empty() && *acked_.begin() == count) {
+            acked_.erase(acked_.begin());
+            count++;
+        }
+        count_.store(count, memory_order_release);
+    }
+
+   private:
+    atomic<uint64_t> count_;
+    mutex mutex_;
+    set<uint64_t> acked_;
+};
+
+// Nanosecond latencies. Every power of two is split into 32 buckets, so a
+// percentile is within 3% of the recorded value.
+using LatencyHistogram = LogLinearHistogram<5>;
+
+// Zipfian item picker of Gray et al., as used by YCSB. Item 0 is the most
+// popular, the item count can grow between calls.
+class Zipfian {
+   public:
+    explicit Zipfian(double theta) : theta_(theta), alpha_(1 / (1 - theta)), zeta2_(1 + std::pow(0.5, theta)) {}
+
+    uint64_t next(mt19937_64& rng, uint64_t items) {
+        if (items > items_) {
+            for (auto i = items_; i < items; i++) {
+                zetan_ += 1 / std::pow(i + 1, theta_);
+            }
+            items_ = items;
+            eta_ = (1 - std::pow(2.0 / items_, 1 - theta_)) / (1 - zeta2_ / zetan_);
+        }
+        auto u = uniform_real_distribution<double>(0, 1)(rng);
+        auto uz = u * zetan_;
+        if (uz < 1) {
+            return 0;
+        }
+        if (uz < zeta2_) {
+            return 1;
+        }
+        return std::min(items - 1, static_cast<uint64_t>(items_ * std::pow(eta_ * u - eta_ + 1, alpha_)));
+    }
+
+   private:
+    double theta_;
+    double alpha_;
+    double zeta2_;
+    double zetan_ = 0;
+    double eta_ = 0;
+    uint64_t items_ = 0;
+};
+
+// Per thread state of the run.
+struct Client {
+    explicit Client(uint64_t seed) : rng(seed), zipfian(FLAGS_zipfian_theta) {
+        // Values are slices of one random buffer.
+        auto size = std::max(FLAGS_value_size, FLAGS_value_size_max);
+        uniform_int_distribution<int> chars('a', 'z');
+        values.resize(2 * size + 1);
+        for (auto& c : values) {
+            c = static_cast<char>(chars(rng));
+        }
+    }
+
+    string value() {
+        auto size = FLAGS_value_size;
+        if (FLAGS_value_size_max > size) {
+            size = uniform_int_distribution<uint64_t>(size, FLAGS_value_size_max)(rng);
+        }
+        auto offset = uniform_int_distribution<uint64_t>(0, values.size() - size - 1)(rng);
+        return values.substr(offset, size);
+    }
+
+    mt19937_64 rng;
+    Zipfian zipfian;
+    string values;
+    array<uint64_t, kNumOps> not_found{};
+};
+
+Compression compression_of(const string& name) {
+    if (name == "lz4") return Compression::kLZ4;
+    if (name == "zstd") return Compression::kZstd;
+    if (name == "zstd_dict") return Compression::kZstdDict;
+    if (name != "none") {
+        throw runtime_error("unknown compression " + name);
+    }
+    return Compression::kNone;
+}
+
+// Whether dir is missing or only holds the files of a store, so wiping it
+// cannot take anything else with it.
+bool is_store_dir(const string& dir) {
+    if (!filesystem::exists(dir)) {
+        return true;
+    }
+    if (!filesystem::is_directory(dir)) {
+        return false;
+    }
+    for (auto& entry : filesystem::directory_iterator(dir)) {
+        auto extension = entry.path().extension();
+        if (!entry.is_regular_file() || (extension != ".data" && extension != ".hint" && extension != ".tmp" &&
+                                         entry.path().filename() != "zstd.dict")) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint64_t dir_bytes(const string& dir) {
+    uint64_t bytes = 0;
+    for (auto& entry : filesystem::directory_iterator(dir)) {
+        bytes += entry.is_regular_file() ? entry.file_size() : 0;
+    }
+    return bytes;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    gflags::SetUsageMessage("YCSB style benchmark of bitcask");
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+    auto workload_iter = kWorkloads.find(FLAGS_workload);
+    if (workload_iter == kWorkloads.end()) {
+        fprintf(stderr, "unknown workload %s\n", FLAGS_workload.c_str());
+        return 1;
+    }
+    auto& workload = workload_iter->second;
+    auto distribution = FLAGS_distribution.empty() ? workload.distribution : FLAGS_distribution;
+    if (distribution != "uniform" && distribution != "zipfian" && distribution != "latest") {
+        fprintf(stderr, "unknown distribution %s\n", distribution.c_str());
+        return 1;
+    }
+    if (FLAGS_record_count == 0 || FLAGS_threads == 0) {
+        fprintf(stderr, "record_count and threads must be positive\n");
+        return 1;
+    }
+    if (!FLAGS_wipe && !is_store_dir(FLAGS_dir)) {
+        fprintf(stderr, "%s is not a bitcask store, pass --wipe to remove it anyway\n", FLAGS_dir.c_str());
+        return 1;
+    }
+
+    // The store logs to std::cout, keep stdout for the report.
+    auto stdout_buffer = cout.rdbuf(cerr.rdbuf());
+
+    filesystem::remove_all(FLAGS_dir);
+    Params params{.max_data_file_size = FLAGS_max_data_file_size,
+                  .compaction_interval_secs = FLAGS_compaction_interval_secs,
+                  .flush_batch_size = FLAGS_flush_batch_size,
+                  .flush_interval_usecs = FLAGS_flush_interval_usecs,
+                  .write_lanes = FLAGS_write_lanes,
+                  .mmap_reads = FLAGS_mmap_reads,
+                  .value_cache_bytes = FLAGS_value_cache_bytes,
+                  .fsync_mode = FLAGS_fsync,
+                  .compression = compression_of(FLAGS_compression),
+                  .verify_checksums = FLAGS_verify_checksums,
+                  .ordered_index = workload.mix[kScan] > 0};
+    auto store = make_unique<BitCask>(FLAGS_dir, params);
+    auto& bc = *store;
+
+    // Load phase, with a window of puts in flight per thread.
+    constexpr uint64_t kLoadWindow = 1024;
+    auto load_start = chrono::steady_clock::now();
+    {
+        vector<thread> threads;
+        for (uint64_t t = 0; t < FLAGS_threads; t++) {
+            threads.emplace_back([&, t]() {
+                Client client(t);
+                vector<future<bool>> pending;
+                for (auto i = t; i < FLAGS_record_count; i += FLAGS_threads) {
+                    pending.emplace_back(bc.put(key_of(i), client.value()));
+                    if (pending.size() >= kLoadWindow) {
+                        for (auto& f : pending) f.get();
+                        pending.clear();
+                    }
+                }
+                for (auto& f : pending) f.get();
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+    chrono::duration<double> load_secs = chrono::steady_clock::now() - load_start;
+
+    // Run phase. Reads pick among the records inserted so far.
+    atomic<uint64_t> next_insert = FLAGS_record_count;
+    AckedInserts inserted(FLAGS_record_count);
+    atomic<bool> done = false;
+    array<LatencyHistogram, kNumOps> histograms;
+    auto next_index = [&](Client& client) -> uint64_t {
+        auto items = inserted.count();
+        if (distribution == "uniform") {
+            return uniform_int_distribution<uint64_t>(0, items - 1)(client.rng);
+        }
+        auto rank = client.zipfian.next(client.rng, items);
+        return distribution == "latest" ? items - 1 - rank : fnv64(rank) % items;
+    };
+    auto run_op = [&](Client& client, Op op) {
+        auto start = chrono::steady_clock::now();
+        bool found = true;
+        switch (op) {
+            case kRead:
+                found = bc.get(key_of(next_index(client))).has_value();
+                break;
+            case kUpdate:
+            case kWriterUpdate:
+                bc.put(key_of(next_index(client)), client.value()).get();
+                break;
+            case kInsert: {
+                auto index = next_insert++;
+                bc.put(key_of(index), client.value()).get();
+                inserted.ack(index);
+                break;
+            }
+            case kScan: {
+                auto length = uniform_int_distribution<uint64_t>(1, FLAGS_max_scan_length)(client.rng);
+                found = !bc.scan(key_of(next_index(client)), "", length).empty();
+                break;
+            }
+            case kReadModifyWrite: {
+                auto key = key_of(next_index(client));
+                found = bc.get(key).has_value();
+                bc.put(key, client.value()).get();
+                break;
+            }
+            default:
+                break;
+        }
+        histograms[op].record(
+            chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+        client.not_found[op] += !found;
+    };
+
+    vector<unique_ptr<Client>> clients;
+    for (uint64_t t = 0; t < FLAGS_threads + FLAGS_writer_threads; t++) {
+        clients.emplace_back(make_unique<Client>(FLAGS_threads + t));
+        // Sum up the zipfian constants before the clock starts.
+        clients.back()->zipfian.next(clients.back()->rng, FLAGS_record_count);
+    }
+    auto run_start = chrono::steady_clock::now();
+    {
+        vector<thread> writers;
+        for (uint64_t t = 0; t < FLAGS_writer_threads; t++) {
+            writers.emplace_back([&, t]() {
+                auto& client = *clients[FLAGS_threads + t];
+                while (!done.load(memory_order_relaxed)) {
+                    run_op(client, kWriterUpdate);
+                }
+            });
+        }
+        vector<thread> threads;
+        for (uint64_t t = 0; t < FLAGS_threads; t++) {
+            threads.emplace_back([&, t]() {
+                auto& client = *clients[t];
+                discrete_distribution<int> pick(workload.mix.begin(), workload.mix.end());
+                for (uint64_t i = 0; i < FLAGS_operation_count; i++) {
+                    run_op(client, static_cast<Op>(pick(client.rng)));
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        done = true;
+        for (auto& thread : writers) {
+            thread.join();
+        }
+    }
+    chrono::duration<double> run_secs = chrono::steady_clock::now() - run_start;
+    store.reset();
+    cout.rdbuf(stdout_buffer);
+
+    array<uint64_t, kNumOps> not_found{};
+    for (auto& client : clients) {
+        for (int op = 0; op < kNumOps; op++) {
+            not_found[op] += client->not_found[op];
+        }
+    }
+
+    string ops;
+    uint64_t total_ops = 0;
+    for (int op = 0; op < kNumOps; op++) {
+        auto h = histograms[op].snapshot();
+        if (!h.count) {
+            continue;
+        }
+        total_ops += h.count;
+        ops += format(
+            "{}\n      \"{}\": {{\"count\": {}, \"not_found\": {}, \"ops_per_sec\": {:.1f}, \"mean_us\": {:.2f}, "
+            "\"p50_us\": {:.2f}, \"p99_us\": {:.2f}, \"p999_us\": {:.2f}, \"max_us\": {:.2f}}}",
+            ops.empty() ? "" : ",", kOpNames[op], h.count, not_found[op], h.count / run_secs.count(),
+            static_cast<double>(h.sum) / h.count / 1e3, h.p50 / 1e3, h.p99 / 1e3, h.p999 / 1e3, h.max / 1e3);
+    }
+    auto report = format(
+        "{{\n  \"workload\": \"{}\",\n  \"distribution\": \"{}\",\n  \"record_count\": {},\n"
+        "  \"operation_count\": {},\n  \"threads\": {},\n  \"writer_threads\": {},\n  \"value_size\": {},\n"
+        "  \"value_size_max\": {},\n  \"compaction_interval_secs\": {},\n  \"compression\": \"{}\",\n"
+        "  \"verify_checksums\": {},\n"
+        "  \"load\": {{\"seconds\": {:.3f}, \"ops_per_sec\": {:.1f}}},\n"
+        "  \"run\": {{\n    \"seconds\": {:.3f},\n    \"ops_per_sec\": {:.1f},\n    \"ops\": {{{}\n    }}\n  }},\n"
+        "  \"disk_bytes\": {}\n}}\n",
+        FLAGS_workload, distribution, FLAGS_record_count, FLAGS_operation_count, FLAGS_threads, FLAGS_writer_threads,
+        FLAGS_value_size, std::max(FLAGS_value_size, FLAGS_value_size_max), FLAGS_compaction_interval_secs,
+        FLAGS_compression, FLAGS_verify_checksums, load_secs.count(), FLAGS_record_count / load_secs.count(),
+        run_secs.count(), total_ops / run_secs.count(), ops, dir_bytes(FLAGS_dir));
+    cout << report;
+    if (!FLAGS_output.empty()) {
+        ofstream(FLAGS_output) << report;
+    }
+    return 0;
+}
@@ -21,33 +21,257 @@ THE SOFTWARE.
 */
 
 #pragma once
+#include <folly/Executor.h>
+#include <folly/futures/Future.h>
+
+#include <functional>
 #include <future>
 #include <memory>
 #include <optional>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 namespace bitcask {
 
+enum class IoBackendType {
+    kPosix,
+    // Needs the library built with BITCASK_WITH_IO_URING, else falls back to kPosix.
+    kIoUring,
+};
+
+enum class Compression {
+    kNone,
+    kLZ4,
+    kZstd,
+    // zstd, with a dictionary trained on the first small values for values up
+    // to 4KB. Needs the library built with BITCASK_WITH_ZSTD_DICT, else falls
+    // back to kZstd.
+    kZstdDict,
+};
+
+struct CacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t entries = 0;
+    uint64_t bytes = 0;
+};
+
+// Distribution of a latency or a size, as reported by BitCask::stats.
+// Percentiles are within 1/8 of the exact value.
+struct HistogramStats {
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+    uint64_t p50 = 0;
+    uint64_t p99 = 0;
+    uint64_t p999 = 0;
+};
+
+struct DataFileStats {
+    uint64_t file_id = 0;
+    uint64_t bytes = 0;
+    // Bytes of overwritten or removed records and of tombstones.
+    uint64_t dead_bytes = 0;
+    double dead_ratio = 0;
+    bool sealed = false;
+};
+
+// Counters since open, latencies in nanoseconds.
+struct Stats {
+    // From put, remove or write until its future completes, which includes
+    // the fdatasync with fsync_mode.
+    HistogramStats put_latency_nsecs;
+    // Writes waiting in the queues of all lanes right now.
+    uint64_t write_queue_depth = 0;
+    // Writes left in its lane's queue when a flush batch was closed.
+    HistogramStats write_queue_depth_at_flush;
+    // Key and value bytes of each flush batch, after compression.
+    HistogramStats flush_batch_bytes;
+    HistogramStats flush_batch_records;
+    // Time a write thread spends writing one batch to its data file.
+    HistogramStats write_records_nsecs;
+    // Latency of get, get_into and get_with by where the value came from.
+    HistogramStats get_cache_nsecs;
+    HistogramStats get_mmap_nsecs;
+    HistogramStats get_pread_nsecs;
+    // Gets of missing keys, or whose value could not be read.
+    uint64_t get_misses = 0;
+    uint64_t keys = 0;
+    uint64_t key_dir_bytes = 0;
+    uint64_t compaction_bytes_read = 0;
+    uint64_t compaction_bytes_written = 0;
+    // Disk space freed by compaction.
+    uint64_t compaction_bytes_reclaimed = 0;
+    uint64_t merges = 0;
+    // Completed runs of the background compaction thread, whether they
+    // merged anything or not.
+    uint64_t compaction_passes = 0;
+    CacheStats cache;
+    // Every data file in id order.
+    std::vector<DataFileStats> data_files;
+};
+
 struct Params {
     uint64_t max_data_file_size = 512 * 1024 * 1024;
     uint64_t compaction_interval_secs = 0;
     uint64_t flush_batch_size = 8 * 1024 * 1024;
     uint64_t flush_interval_usecs = 50;
+    // Independent write paths, each with its own queue, flush and write
+    // threads and active data file. Keys are assigned to lanes by hash. A
+    // WriteBatch spanning lanes holds up the other lanes it writes until it
+    // is written.
+    uint64_t write_lanes = 1;
+    // Threads used to issue the reads of a multi_get in parallel, 0 reads inline.
+    uint64_t read_threads = 4;
+    // Threads used to rebuild the KeyDir at open, 0 uses one per core.
+    uint64_t load_threads = 0;
+    // Serve reads of sealed data files from a read-only mmap instead of pread.
+    bool mmap_reads = false;
+    // Byte budget of the in-memory cache of hot values, 0 disables it.
+    uint64_t value_cache_bytes = 0;
+    // Complete put futures only once the data is on disk. Writes are group
+    // committed with one fdatasync per flush batch.
     bool fsync_mode = false;
+    // With fsync_mode, batches that queue up while a batch is written share a
+    // single fdatasync, as long as the oldest one waited less than this.
+    uint64_t max_sync_delay_usecs = 200;
+    // How data files are read and written.
+    IoBackendType io_backend = IoBackendType::kPosix;
+    // Submission queue entries of the shared ring of the io_uring backend.
+    uint32_t io_uring_queue_depth = 256;
+    // Compaction rewrites a larger sealed file once this fraction of its
+    // bytes is overwritten or removed data.
     double compact_dead_ratio = 0.4;
+    // Sealed files with less live data than this fraction of
+    // max_data_file_size are merged together by compaction.
     double merge_min_data_file_ratio = 0.3;
+    // Bytes per second compaction may read and write, 0 is unlimited. Can be
+    // changed at runtime with BitCask::set_compaction_rate.
+    uint64_t compaction_rate_bytes_per_sec = 0;
+    // Compaction backs off while more than this many writes are queued, 0
+    // disables it.
+    uint64_t compaction_backoff_queue_depth = 0;
+    // Compaction backs off while the average get latency is above this, 0
+    // disables it and the get latency sampling.
+    uint64_t compaction_backoff_get_latency_usecs = 0;
+    // Codec values are compressed with. Compaction re-encodes the values it
+    // moves when this changes.
+    Compression compression = Compression::kNone;
+    // Values smaller than this are stored uncompressed.
+    uint64_t compression_min_value_size = 128;
+    // Size of the kZstdDict dictionary, trained on 100 times as many bytes.
+    uint64_t compression_dict_bytes = 16 * 1024;
+    // Check the CRC32C of every record a get reads, a mismatch is reported
+    // and the key is treated as missing. Recovery always checks them.
+    // Costs a pass over every record read: with 4KB values, about 10% of get
+    // throughput through pread and about 30% from mapped files.
+    bool verify_checksums = false;
+    // Also keep the keys in a sorted index, which scan and prefix_scan need.
+    // Costs a second copy of every key in memory.
+    bool ordered_index = false;
+    // Called with BitCask::stats from a background thread every
+    // stats_export_interval_secs, when both are set.
+    std::function<void(const Stats&)> stats_exporter;
+    uint64_t stats_export_interval_secs = 0;
+    // Threads serving get_async, which bounds how many of its reads are on
+    // disk at once. 0 serves get_async on the calling thread.
+    uint64_t async_read_threads = 8;
+    // get_async fails while this many of its reads are queued or running, 0
+    // is unlimited.
+    uint64_t max_pending_async_reads = 65536;
+    // Serves get_async in place of a pool of async_read_threads, so stores can
+    // share one. Closing the store waits for its reads still on it, so the
+    // executor must outlive the store and run everything added to it.
+    std::shared_ptr<folly::Executor> async_read_executor;
+    // Compaction copies runs of live records with copy_file_range. Off, they
+    // go through a buffer, for filesystems where the kernel copy is slow.
+    bool compaction_kernel_copy = true;
 };
 
 class BitCaskImpl;
 
+// Largest value put and WriteBatch accept, the KeyDir keeps value sizes in 32 bits.
+constexpr uint64_t kMaxValueSize = UINT32_MAX;
+
+// A group of puts and removes applied atomically by BitCask::write.
+class WriteBatch {
+   public:
+    void put(const std::string& key, const std::string& value) {
+        if (value.size() > kMaxValueSize) {
+            throw std::runtime_error("value larger than kMaxValueSize");
+        }
+        ops_.emplace_back(Op{key, value, false});
+    }
+    void remove(const std::string& key) { ops_.emplace_back(Op{key, {}, true}); }
+    size_t size() const { return ops_.size(); }
+    bool empty() const { return ops_.empty(); }
+    void clear() { ops_.clear(); }
+
+   private:
+    friend class BitCaskImpl;
+    struct Op {
+        std::string key;
+        std::string value;
+        bool tombstone;
+    };
+    std::vector<Op> ops_;
+};
+
 class BitCask {
    public:
     BitCask(const std::string& dir, const Params& params);
     ~BitCask();
 
+    // Throws std::runtime_error for a value larger than kMaxValueSize.
     std::future<bool> put(const std::string& key, const std::string& value);
     std::optional<std::string> get(const std::string& key) const;
+    // Like get, but the read runs on the async read threads so the caller
+    // never blocks on disk. The future fails with std::runtime_error when
+    // max_pending_async_reads reads are already pending.
+    folly::SemiFuture<std::optional<std::string>> get_async(const std::string& key) const;
+    // Copies the value into buffer and returns its size. Nothing is copied
+    // when the value is larger than buffer, retry with the returned size.
+    std::optional<uint64_t> get_into(const std::string& key, std::span<char> buffer) const;
+    // Calls fn with the value, without a copy when the value is mapped. The
+    // view is only valid during the call. Returns false if the key is missing.
+    bool get_with(const std::string& key, const std::function<void(std::string_view)>& fn) const;
+    // Looks up all the keys at once, the result is in the same order as keys.
+    std::vector<std::optional<std::string>> multi_get(std::span<const std::string> keys) const;
     std::future<bool> remove(const std::string& key);
+    // Returns the keys in [begin, end) and their values in key order, at most
+    // limit of them unless it is 0. An empty end scans to the last key. The
+    // values are read in file order. Page through a large range by scanning
+    // again from the last key plus a '\0'. Needs Params::ordered_index.
+    std::vector<std::pair<std::string, std::string>> scan(const std::string& begin, const std::string& end,
+                                                          uint64_t limit = 0) const;
+    // Like scan, over all the keys that start with prefix.
+    std::vector<std::pair<std::string, std::string>> prefix_scan(const std::string& prefix, uint64_t limit = 0) const;
+    // Calls fn with every live key and its value in the order they are stored
+    // on disk, reading the data files sequentially, until fn returns false.
+    // Compaction leaves the files alone until the fold is done. A key written
+    // during the fold may be seen with its old value, its new one or both.
+    // Returns false if a data file could not be read through.
+    bool fold(const std::function<bool(std::string_view key, std::string_view value)>& fn) const;
+    // Writes all the puts and removes in the batch to the same data file and
+    // makes them visible together. The future completes once for the batch.
+    std::future<bool> write(WriteBatch&& batch);
+
+    // Hit and miss counters of the value cache.
+    CacheStats cache_stats() const;
+    // Latency histograms, queue and batch sizes, KeyDir size and compaction
+    // counters. Cheap enough to poll, but walks all the data files.
+    Stats stats() const;
+
+    // Changes the compaction I/O limit, 0 is unlimited.
+    void set_compaction_rate(uint64_t bytes_per_sec);
+    // Stops compaction before the next file until resume_compaction.
+    void pause_compaction();
+    void resume_compaction();
 
    private:
     std::unique_ptr<BitCaskImpl> impl_;
@@ -20,12 +20,18 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
+#include <algorithm>
+#include <cassert>
+#include <chrono>
 #include <cstdint>
 #include <filesystem>
 #include <iostream>
+#include <latch>
 #include <memory>
 #include <set>
 #include <string>
+#include <tuple>
+#include <utility>
 #include <vector>
 
 #include "bitcask_impl.hpp"
@@ -44,18 +50,151 @@ std::future<bool> BitCask::put(const std::string& key, const std::string& value)
 std::optional<std::string> BitCask::get(const std::string& key) const {
     return impl_->get(key);
 }
+folly::SemiFuture<std::optional<std::string>> BitCask::get_async(const std::string& key) const {
+    return impl_->get_async(key);
+}
+std::optional<uint64_t> BitCask::get_into(const std::string& key, std::span<char> buffer) const {
+    return impl_->get_into(key, buffer);
+}
+bool BitCask::get_with(const std::string& key, const std::function<void(std::string_view)>& fn) const {
+    return impl_->get_with(key, fn);
+}
+std::vector<std::optional<std::string>> BitCask::multi_get(std::span<const std::string> keys) const {
+    return impl_->multi_get(keys);
+}
 std::future<bool> BitCask::remove(const std::string& key) { return impl_->remove(key); }
+bool BitCask::fold(const std::function<bool(std::string_view key, std::string_view value)>& fn) const {
+    return impl_->fold(fn);
+}
+std::vector<std::pair<std::string, std::string>> BitCask::scan(const std::string& begin, const std::string& end,
+                                                               uint64_t limit) const {
+    return impl_->scan(begin, end, limit);
+}
+std::vector<std::pair<std::string, std::string>> BitCask::prefix_scan(const std::string& prefix,
+                                                                      uint64_t limit) const {
+    return impl_->scan(prefix, OrderedIndex::prefix_end(prefix), limit);
+}
+std::future<bool> BitCask::write(WriteBatch&& batch) { return impl_->write(std::move(batch)); }
+CacheStats BitCask::cache_stats() const { return impl_->cache_stats(); }
+Stats BitCask::stats() const { return impl_->stats(); }
+void BitCask::set_compaction_rate(uint64_t bytes_per_sec) { impl_->set_compaction_rate(bytes_per_sec); }
+void BitCask::pause_compaction() { impl_->pause_compaction(); }
+void BitCask::resume_compaction() { impl_->resume_compaction(); }
+
+namespace {
+uint64_t nsecs_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Where a get found its value, kMiss until it does.
+enum class GetSource { kMiss, kCache, kMmap, kPread };
+
+GetSource read_source(const DataFile* data_file, const KeyDirEntry& entry) {
+    return data_file->mapped(entry.value_offset, entry.value_size) ? GetSource::kMmap : GetSource::kPread;
+}
+
+// Times every get into the histogram of where its value came from, and one
+// in kSampleRate into a moving average, which compaction watches to back off
+// when foreground reads slow down.
+class GetLatencySample {
+   public:
+    GetLatencySample(StoreStats& stats, LatencyAverage* average)
+        : stats_(stats), start_(std::chrono::steady_clock::now()) {
+        thread_local uint32_t count = 0;
+        if (average && count++ % kSampleRate == 0) {
+            average_ = average;
+        }
+    }
+
+    void set_source(GetSource source) { source_ = source; }
+
+    ~GetLatencySample() {
+        auto now = std::chrono::steady_clock::now();
+        uint64_t nsecs = std::chrono::duration_cast<std::chrono::nanoseconds>(now - start_).count();
+        switch (source_) {
+            case GetSource::kMiss:
+                stats_.get_misses.add();
+                break;
+            case GetSource::kCache:
+                stats_.get_cache_latency.record(nsecs);
+                break;
+            case GetSource::kMmap:
+                stats_.get_mmap_latency.record(nsecs);
+                break;
+            case GetSource::kPread:
+                stats_.get_pread_latency.record(nsecs);
+                break;
+        }
+        if (!average_) {
+            return;
+        }
+        // Racing updates may lose a sample, which is fine for an average.
+        auto average = average_->nsecs.load(std::memory_order_relaxed);
+        average_->nsecs.store(average - average / 8 + nsecs / 8, std::memory_order_relaxed);
+        average_->updated_at.store(now.time_since_epoch().count(), std::memory_order_relaxed);
+    }
 
-BitCaskImpl::BitCaskImpl(const std::string& dir, const Params& params) : data_dir_(dir), params_(params), flush_queue_(65536) {
+   private:
+    static constexpr uint32_t kSampleRate = 64;
+    StoreStats& stats_;
+    LatencyAverage* average_ = nullptr;
+    GetSource source_ = GetSource::kMiss;
+    std::chrono::steady_clock::time_point start_;
+};
+}  // namespace
+
+BitCaskImpl::BitCaskImpl(const std::string& dir, const Params& params)
+    : data_dir_(dir),
+      params_(params),
+      io_backend_(make_io_backend(params)),
+      compaction_limiter_(params.compaction_rate_bytes_per_sec) {
+    if (params_.read_threads) {
+        read_executor_ = std::make_unique<folly::CPUThreadPoolExecutor>(params_.read_threads);
+    }
+    if (params_.async_read_executor) {
+        async_read_executor_ = params_.async_read_executor;
+    } else if (params_.async_read_threads) {
+        async_read_executor_ = std::make_shared<folly::CPUThreadPoolExecutor>(params_.async_read_threads);
+    }
+    if (params_.value_cache_bytes) {
+        value_cache_ = std::make_unique<ValueCache>(params_.value_cache_bytes);
+    }
+    if (params_.ordered_index) {
+        ordered_index_ = std::make_unique<OrderedIndex>();
+    }
+    value_codec_ = std::make_unique<ValueCodec>(params_, (fs::path(data_dir_) / "zstd.dict").string());
     init();
 }
 
 BitCaskImpl::~BitCaskImpl() {
-    stop_ = truncate64;
-    flush_thread_.join();
+    // Let the pending async gets finish while the store is still whole. The
+    // executor may be shared, so wait for this store's reads only.
+    {
+        std::unique_lock lock(async_reads_mutex_);
+        async_reads_done_.wait(lock, [&]() { return pending_async_reads_.load(std::memory_order_relaxed) == 0; });
+    }
+    {
+        std::lock_guard lock(compact_mutex_);
+        stop_ = true;
+    }
+    compact_cv_.notify_all();
+    compaction_limiter_.cancel();
+    for (auto& lane : lanes_) {
+        lane->flush_thread.join();
+        lane->write_thread.join();
+    }
     if (params_.compaction_interval_secs) {
         compact_thread_.join();
     }
+    if (stats_thread_.joinable()) {
+        stats_thread_.join();
+    }
+    // Wait for the files retired by compaction to be removed.
+    folly::rcu_barrier();
+    // Seal the active files so the next open can load them from their hint files.
+    for (auto& lane : lanes_) {
+        lane->active_data_file->seal(hint_file_path(lane->active_data_file->id()));
+    }
     std::cout << "~BitCaskImpl" << std::endl;
 }
 
@@ -64,11 +203,26 @@ void BitCaskImpl::init() {
         fs::create_directory(data_dir_);
         last_file_id_ = 0;
     } else {
+        // Remove files left behind by an interrupted compaction or hint write.
+        std::vector<fs::path> tmp_files;
+        for (const auto& entry : fs::directory_iterator(data_dir_)) {
+            if (entry.is_regular_file() && entry.path().extension() == ".tmp") {
+                tmp_files.emplace_back(entry.path());
+            }
+        }
+        for (auto& tmp_file : tmp_files) {
+            fs::remove(tmp_file);
+        }
+
         for (const auto& entry : fs::directory_iterator(data_dir_)) {
             if (entry.is_regular_file() && entry.path().extension() == ".data") {
                 auto file_id = std::stoul(entry.path().stem().string());
                 last_file_id_ = std::max(last_file_id_.load(), file_id);
-                data_files_.insert(file_id, std::make_shared<DataFile>(entry.path().string(), file_id, false /* write */));
+                auto data_file = std::make_shared<DataFile>(entry.path().string(), file_id, false /* write */, io_backend_);
+                if (params_.mmap_reads) {
+                    data_file->map();
+                }
+                data_files_.insert(file_id, std::move(data_file));
             }
         }
     }
@@ -76,101 +230,895 @@ void BitCaskImpl::init() {
     // Load all data files.
     load_all_data_files();
 
-    // Create a new data file during init.
-    create_new_data_file(true);
-
-    // Start flush and compact thread
-    flush_thread_ = std::thread(&BitCaskImpl::flush_worker, this);
+    // Create the lanes, each with a new data file and its flush and write thread.
+    for (uint64_t i = 0; i < std::max<uint64_t>(1, params_.write_lanes); i++) {
+        auto& lane = *lanes_.emplace_back(std::make_unique<WriteLane>());
+        if (!create_new_data_file(lane)) {
+            throw std::runtime_error("Failed to create a data file");
+        }
+        lane.write_thread = std::thread(&BitCaskImpl::write_worker, this, std::ref(lane));
+        lane.flush_thread = std::thread(&BitCaskImpl::flush_worker, this, std::ref(lane));
+    }
     if (params_.compaction_interval_secs) {
         compact_thread_ = std::thread(&BitCaskImpl::compact_worker, this);
     }
+    if (params_.stats_exporter && params_.stats_export_interval_secs) {
+        stats_thread_ = std::thread(&BitCaskImpl::stats_worker, this);
+    }
 }
 
 std::future<bool> BitCaskImpl::put(const std::string& key, const std::string& value, bool tombstone) {
-    auto record = std::make_shared<KVQueueEntry>(key, value, tombstone);
-    flush_queue_.blockingWrite(record);
-    return record->flush_promise.get_future();
+    if (value.size() > kMaxValueSize) {
+        throw std::runtime_error("value larger than kMaxValueSize");
+    }
+    auto entry = std::make_shared<KVQueueEntry>();
+    entry->records.emplace_back(DataRecord{key, value, tombstone});
+    return enqueue(std::move(entry));
 }
 
-void BitCaskImpl::flush_worker() {
-    auto last_flush_time = std::chrono::high_resolution_clock::now();
-    while (true) {
-        if (stop_.load()) break;
+std::future<bool> BitCaskImpl::write(WriteBatch&& batch) {
+    if (batch.empty()) {
+        std::promise<bool> p;
+        p.set_value(true);
+        return p.get_future();
+    }
 
-        std::vector<DataRecord> batch;
-        std::shared_ptr<KVQueueEntry> entry;
-        std::vector<std::promise<bool>> promises;
-        uint64_t size = 0;
-        while (true) {
+    auto entry = std::make_shared<KVQueueEntry>();
+    entry->records.reserve(batch.ops_.size());
+    auto& lane = lane_for(batch.ops_.front().key);
+    std::vector<WriteLane*> other_lanes;
+    for (auto& op : batch.ops_) {
+        auto& op_lane = lane_for(op.key);
+        if (&op_lane != &lane && std::find(other_lanes.begin(), other_lanes.end(), &op_lane) == other_lanes.end()) {
+            other_lanes.emplace_back(&op_lane);
+        }
+        entry->records.emplace_back(DataRecord{std::move(op.key), std::move(op.value), op.tombstone});
+    }
+    batch.clear();
+    if (other_lanes.empty()) {
+        return enqueue(std::move(entry));
+    }
+
+    // The other lanes get a barrier in place of the batch, so the writes
+    // queued on them before and after it are ordered around it.
+    entry->fence = std::make_shared<WriteFence>();
+    entry->fence->lanes_pending = other_lanes.size();
+    std::lock_guard lock(fence_mutex_);
+    for (auto* other_lane : other_lanes) {
+        auto barrier = std::make_shared<KVQueueEntry>();
+        barrier->fence = entry->fence;
+        other_lane->queue.blockingWrite(std::move(barrier));
+    }
+    return enqueue(std::move(entry));
+}
+
+WriteLane& BitCaskImpl::lane_for(const std::string& key) {
+    if (lanes_.size() == 1) {
+        return *lanes_[0];
+    }
+    return *lanes_[std::hash<std::string>{}(key) % lanes_.size()];
+}
+
+std::future<bool> BitCaskImpl::enqueue(std::shared_ptr<KVQueueEntry> entry) {
+    // Take the future before enqueueing, the flush thread moves the promise out.
+    auto future = entry->flush_promise.get_future();
+    entry->enqueued_at = std::chrono::steady_clock::now();
+    // A batch goes to the lane of its first key.
+    lane_for(entry->records.front().key).queue.blockingWrite(std::move(entry));
+    return future;
+}
+
+void BitCaskImpl::flush_worker(WriteLane& lane) {
+    // Bound on how long the flush thread sleeps on an idle queue before
+    // re-checking stop_. Producers wake it immediately through the queue.
+    constexpr auto kIdleWait = std::chrono::milliseconds(100);
+    FlushBatch batch;
+    std::shared_ptr<KVQueueEntry> entry;
+    auto add_entry = [&]() {
+        auto fence = std::move(entry->fence);
+        if (fence) {
+            if (!batch.empty()) {
+                handoff_batch(lane, batch);
+            }
+            if (entry->records.empty()) {
+                // A barrier, stop here once this lane wrote what came before
+                // it, until the batch it stands for is written.
+                {
+                    std::unique_lock lock(lane.batch_mutex);
+                    lane.batch_cv.wait(lock, [&] { return !lane.pending_ready && !lane.writer_busy; });
+                }
+                std::unique_lock lock(fence->mutex);
+                if (--fence->lanes_pending == 0) {
+                    fence->cv.notify_all();
+                }
+                fence->cv.wait(lock, [&] { return fence->written; });
+                entry.reset();
+                return;
+            }
+            // The batch is written alone once all the other lanes stopped.
+            std::unique_lock lock(fence->mutex);
+            fence->cv.wait(lock, [&] { return fence->lanes_pending == 0; });
+            batch.fence = std::move(fence);
+        }
+        batch.atomic |= entry->records.size() > 1;
+        for (auto& record : entry->records) {
+            if (!record.tombstone) {
+                std::string compressed;
+                record.codec = value_codec_->compress(record.value, compressed);
+                if (record.codec != kRaw) {
+                    record.value = std::move(compressed);
+                }
+            }
+            batch.size += record.key.size() + record.value.size();
+            batch.records.emplace_back(std::move(record));
+        }
+        batch.promises.emplace_back(std::move(entry->flush_promise));
+        batch.enqueued_at.emplace_back(entry->enqueued_at);
+        entry.reset();
+        if (batch.fence) {
+            handoff_batch(lane, batch);
+        }
+    };
+
+    while (true) {
+        // Block until a producer enqueues something.
+        if (!lane.queue.tryReadUntil(std::chrono::steady_clock::now() + kIdleWait, entry)) {
             if (stop_.load()) break;
-            auto ret = flush_queue_.read(entry);
-            if (ret) {
-                batch.emplace_back(DataRecord{entry->key, entry->value, entry->tombstone});
-                promises.emplace_back(std::move(entry->flush_promise));
-                size += entry->key.size() + entry->value.size();
-            }
-            std::this_thread::sleep_for(std::chrono::microseconds(10));
-            auto now = std::chrono::high_resolution_clock::now();
-            if (size >= params_.flush_batch_size ||
-                std::chrono::duration_cast<std::chrono::microseconds>(now - last_flush_time).count() >= params_.flush_interval_usecs) {
-                break;
+            continue;
+        }
+        add_entry();
+
+        // Drain everything queued, up to flush_batch_size. Once the queue is
+        // empty keep gathering until flush_interval_usecs only while the write
+        // thread is still busy with the previous batch.
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(params_.flush_interval_usecs);
+        while (batch.size < params_.flush_batch_size) {
+            if (lane.queue.read(entry)) {
+                add_entry();
+                continue;
+            }
+            {
+                std::lock_guard lock(lane.batch_mutex);
+                if (!lane.pending_ready && !lane.writer_busy) break;
             }
+            if (!lane.queue.tryReadUntil(deadline, entry)) break;
+            add_entry();
         }
 
+        stats_.write_queue_depth.record(std::max<ssize_t>(0, lane.queue.size()));
         if (!batch.empty()) {
-            flush_data_records(batch);
-            for (auto& promise : promises) {
-                promise.set_value(true);
-            }
+            handoff_batch(lane, batch);
         }
-        last_flush_time = std::chrono::high_resolution_clock::now();
     }
+
+    // Flush whatever is left in the queue before exiting.
+    while (lane.queue.read(entry)) {
+        add_entry();
+    }
+    if (!batch.empty()) {
+        handoff_batch(lane, batch);
+    }
+    {
+        std::lock_guard lock(lane.batch_mutex);
+        lane.flush_done = true;
+    }
+    lane.batch_cv.notify_all();
     std::cout << "Flush thread exiting " << std::endl;
 }
 
-bool BitCaskImpl::flush_data_records(std::vector<DataRecord>& batch) {
-    if (active_data_file_->size() > params_.max_data_file_size) {
-        create_new_data_file(false /*init*/);
+void BitCaskImpl::handoff_batch(WriteLane& lane, FlushBatch& batch) {
+    std::unique_lock lock(lane.batch_mutex);
+    lane.batch_cv.wait(lock, [&] { return !lane.pending_ready; });
+    std::swap(batch, lane.pending_batch);
+    lane.pending_ready = true;
+    lock.unlock();
+    lane.batch_cv.notify_all();
+    batch.clear();
+}
+
+void BitCaskImpl::write_worker(WriteLane& lane) {
+    FlushBatch batch;
+    // With fsync_mode, batches written but not yet synced. Their promises are
+    // completed by one fdatasync that covers all of them.
+    std::vector<std::tuple<std::promise<bool>, bool, std::chrono::steady_clock::time_point>> unsynced;
+    std::chrono::steady_clock::time_point first_unsynced_time;
+    auto sync = [&]() {
+        // Writes of a file sealed since were synced by the seal.
+        auto seal_failed = std::exchange(lane.seal_failed, false);
+        auto synced = lane.active_data_file->sync() && !seal_failed;
+        for (auto& [promise, ret, enqueued_at] : unsynced) {
+            stats_.put_latency.record(nsecs_since(enqueued_at));
+            promise.set_value(ret && synced);
+        }
+        unsynced.clear();
+    };
+
+    while (true) {
+        {
+            std::unique_lock lock(lane.batch_mutex);
+            lane.batch_cv.wait(lock, [&] { return lane.pending_ready || lane.flush_done; });
+            if (!lane.pending_ready) break;
+            std::swap(batch, lane.pending_batch);
+            lane.pending_ready = false;
+            lane.writer_busy = true;
+        }
+        lane.batch_cv.notify_all();
+
+        auto ret = flush_data_records(lane, batch);
+        if (batch.fence) {
+            {
+                std::lock_guard fence_lock(batch.fence->mutex);
+                batch.fence->written = true;
+            }
+            batch.fence->cv.notify_all();
+        }
+        if (!params_.fsync_mode) {
+            for (size_t i = 0; i < batch.promises.size(); i++) {
+                stats_.put_latency.record(nsecs_since(batch.enqueued_at[i]));
+                batch.promises[i].set_value(ret);
+            }
+        } else {
+            if (unsynced.empty()) {
+                first_unsynced_time = std::chrono::steady_clock::now();
+            }
+            for (size_t i = 0; i < batch.promises.size(); i++) {
+                unsynced.emplace_back(std::move(batch.promises[i]), ret, batch.enqueued_at[i]);
+            }
+        }
+        batch.clear();
+
+        std::unique_lock lock(lane.batch_mutex);
+        if (!unsynced.empty()) {
+            // Fold the next batch into the same sync if it is already waiting
+            // and the oldest unsynced write has not waited max_sync_delay_usecs.
+            auto waited = std::chrono::steady_clock::now() - first_unsynced_time;
+            if (lane.pending_ready && waited < std::chrono::microseconds(params_.max_sync_delay_usecs)) {
+                continue;
+            }
+            lock.unlock();
+            sync();
+            lock.lock();
+        }
+        lane.writer_busy = false;
+        // A barrier may be waiting for the lane to go idle.
+        lane.batch_cv.notify_all();
+    }
+    if (!unsynced.empty()) {
+        sync();
+    }
+    std::cout << "Write thread exiting " << std::endl;
+}
+
+bool BitCaskImpl::flush_data_records(WriteLane& lane, FlushBatch& batch) {
+    if (lane.active_data_file->size() > params_.max_data_file_size && !create_new_data_file(lane)) {
+        return false;
     }
 
-    auto data_file = active_data_file_;
-    if (!data_file->write_records(batch)) {
+    // Lanes never write the same key, except a batch spanning lanes, which
+    // the other lanes it writes wait for at their barriers. So every key is
+    // numbered, written and applied in the order its writes were queued.
+    auto seq = next_seq_.fetch_add(batch.records.size());
+    for (auto& record : batch.records) {
+        record.seq = seq++;
+    }
+
+    auto data_file = lane.active_data_file;
+    auto write_start = std::chrono::steady_clock::now();
+    if (!data_file->write_records(batch.records)) {
         return false;
     }
+    stats_.write_records_latency.record(nsecs_since(write_start));
+    stats_.flush_batch_bytes.record(batch.size);
+    stats_.flush_batch_records.record(batch.records.size());
 
-    std::shared_lock lock(io_mutex_);
-    for (auto& record : batch) {
+    // Readers retry lookups that overlap a multi-record batch, so it becomes
+    // visible all at once.
+    std::unique_lock apply_lock(apply_mutex_, std::defer_lock);
+    if (batch.atomic) {
+        apply_lock.lock();
+        apply_version_.fetch_add(1, std::memory_order_acq_rel);
+    }
+    for (auto& record : batch.records) {
         if (record.tombstone) {
-            key_dir_.remove(record.key);
+            data_file->add_tombstones(1, data_file->record_size(record.seq, record.key.size(), 0));
+            if (auto previous = key_dir_.remove(record.key)) {
+                mark_dead(record.key.size(), previous.value());
+                if (ordered_index_) ordered_index_->remove(record.key);
+            }
+            if (value_cache_) value_cache_->erase(record.key);
         } else {
-            KeyDirEntry entry{.file_id = data_file->id(), .value_size = record.value.size(), .value_offset = record.value_offset};
-            key_dir_.insert(record.key, entry);
+            KeyDirEntry entry{.file_id = data_file->id(),
+                              .value_size = record.value.size(),
+                              .value_offset = record.value_offset,
+                              .tstamp = record.seq,
+                              .codec = record.codec};
+            if (auto previous = key_dir_.insert(record.key, entry)) {
+                mark_dead(record.key.size(), previous.value());
+            } else if (ordered_index_) {
+                ordered_index_->insert(record.key);
+            }
+            if (value_cache_) {
+                // The cache holds plain values, the written one may be compressed.
+                if (record.codec == kRaw) {
+                    value_cache_->update(record.key, entry, record.value);
+                } else {
+                    value_cache_->erase(record.key);
+                }
+            }
         }
     }
+    if (apply_lock.owns_lock()) {
+        apply_version_.fetch_add(1, std::memory_order_release);
+    }
 
     return true;
 }
 
+void BitCaskImpl::mark_dead(uint64_t key_size, const KeyDirEntry& entry) {
+    auto iter = data_files_.find(entry.file_id);
+    if (iter != data_files_.end()) {
+        iter->second->add_dead_records(1, iter->second->record_size(entry.tstamp, key_size, entry.value_size));
+    }
+}
+
+const DataFile* BitCaskImpl::find_data_file(uint64_t file_id) const {
+    auto iter = data_files_.find(file_id);
+    if (iter == data_files_.cend()) {
+        return nullptr;
+    }
+    return iter->second.get();
+}
+
+std::optional<std::pair<KeyDirEntry, const DataFile*>> BitCaskImpl::locate(const std::string& key) const {
+    std::optional<uint64_t> missing_file;
+    while (true) {
+        auto version = apply_version_.load(std::memory_order_acquire);
+        if (version & 1) {
+            std::this_thread::yield();
+            continue;
+        }
+        auto ret = key_dir_.get(key);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (apply_version_.load(std::memory_order_relaxed) != version) {
+            continue;
+        }
+        if (!ret) {
+            return {};
+        }
+        if (auto data_file = find_data_file(ret->file_id)) {
+            return std::make_pair(ret.value(), data_file);
+        }
+        // Compaction moved the value and removed the file since the lookup,
+        // unless a second lookup still points at the same missing file.
+        if (missing_file == ret->file_id) {
+            return {};
+        }
+        missing_file = ret->file_id;
+    }
+}
+
 std::optional<std::string> BitCaskImpl::get(const std::string& key) const {
-    std::shared_lock lock(io_mutex_);
-    auto ret = key_dir_.get(key);
+    GetLatencySample sample(stats_, params_.compaction_backoff_get_latency_usecs ? &get_latency_ : nullptr);
+    folly::rcu_reader guard;
+    auto ret = locate(key);
     if (!ret) {
         return {};
     }
-    auto& key_dir_entry = ret.value();
-    const auto& data_file = data_files_.at(key_dir_entry.file_id);
+    auto& [key_dir_entry, data_file] = ret.value();
+    if (value_cache_) {
+        if (auto cached = value_cache_->get(key, key_dir_entry)) {
+            sample.set_source(GetSource::kCache);
+            return *cached;
+        }
+    }
+    auto value = read_value(key, key_dir_entry, data_file);
+    if (value) {
+        sample.set_source(read_source(data_file, key_dir_entry));
+    }
+    return value;
+}
+
+folly::SemiFuture<std::optional<std::string>> BitCaskImpl::get_async(const std::string& key) const {
+    if (!async_read_executor_) {
+        return folly::makeSemiFuture(get(key));
+    }
+    auto pending = pending_async_reads_.fetch_add(1, std::memory_order_relaxed);
+    if (params_.max_pending_async_reads && pending >= params_.max_pending_async_reads) {
+        pending_async_reads_.fetch_sub(1, std::memory_order_release);
+        return folly::makeSemiFuture<std::optional<std::string>>(std::runtime_error("too many pending async reads"));
+    }
+    folly::Promise<std::optional<std::string>> promise;
+    auto future = promise.getSemiFuture();
+    async_read_executor_->add([this, key, promise = std::move(promise)]() mutable {
+        promise.setWith([&]() { return get(key); });
+        // The last touch of the store, which may be closed right after, so
+        // the wakeup goes out before the lock is let go.
+        std::lock_guard lock(async_reads_mutex_);
+        if (pending_async_reads_.fetch_sub(1, std::memory_order_relaxed) == 1) {
+            async_reads_done_.notify_all();
+        }
+    });
+    return future;
+}
+
+bool BitCaskImpl::verify_record(const std::string& key, const KeyDirEntry& entry, const DataFile* data_file,
+                                const uint8_t* record) const {
+    if (data_file->verify_record(record, data_file->record_size(entry.tstamp, key.size(), entry.value_size))) {
+        return true;
+    }
+    std::cout << "Checksum mismatch for key " << key << " in data file " << entry.file_id << " at "
+              << entry.value_offset << std::endl;
+    return false;
+}
+
+std::optional<std::string> BitCaskImpl::read_value(const std::string& key, const KeyDirEntry& entry,
+                                                   const DataFile* data_file) const {
     std::string buffer;
-    buffer.resize(key_dir_entry.value_size);
-    if (!data_file->read_exact(key_dir_entry.value_offset, reinterpret_cast<uint8_t*>(buffer.data()),
-                               key_dir_entry.value_size)) {
+    if (params_.verify_checksums) {
+        auto header_size = data_file->header_size(entry.tstamp, key.size(), entry.value_size) + key.size();
+        // A mapped record is checked in place and only its value copied out.
+        if (auto record = data_file->mapped(entry.value_offset - header_size, header_size + entry.value_size)) {
+            if (!verify_record(key, entry, data_file, record)) {
+                return {};
+            }
+            buffer.assign(reinterpret_cast<const char*>(record) + header_size, entry.value_size);
+        } else {
+            // Read the whole record and keep only its value once it checks out.
+            buffer.resize(header_size + entry.value_size);
+            if (data_file->read_exact(entry.value_offset - header_size, reinterpret_cast<uint8_t*>(buffer.data()),
+                                      buffer.size()) != buffer.size() ||
+                !verify_record(key, entry, data_file, reinterpret_cast<const uint8_t*>(buffer.data()))) {
+                return {};
+            }
+            buffer.erase(0, header_size);
+        }
+    } else {
+        buffer.resize(entry.value_size);
+        if (data_file->read_exact(entry.value_offset, reinterpret_cast<uint8_t*>(buffer.data()), entry.value_size) !=
+            entry.value_size) {
+            return {};
+        }
+    }
+    if (entry.codec != kRaw) {
+        std::string value;
+        if (!value_codec_->decompress(entry.codec, buffer, value)) {
+            return {};
+        }
+        buffer = std::move(value);
+    }
+    if (value_cache_) {
+        value_cache_->insert(key, entry, buffer);
+    }
+    return buffer;
+}
+
+std::optional<uint64_t> BitCaskImpl::get_into(const std::string& key, std::span<char> buffer) const {
+    GetLatencySample sample(stats_, params_.compaction_backoff_get_latency_usecs ? &get_latency_ : nullptr);
+    folly::rcu_reader guard;
+    auto ret = locate(key);
+    if (!ret) {
+        return {};
+    }
+    auto& [key_dir_entry, data_file] = ret.value();
+    if (value_cache_) {
+        if (auto cached = value_cache_->get(key, key_dir_entry)) {
+            if (cached->size() <= buffer.size()) {
+                std::memcpy(buffer.data(), cached->data(), cached->size());
+            }
+            sample.set_source(GetSource::kCache);
+            return cached->size();
+        }
+    }
+    // The size of a compressed value is only known once it is decompressed,
+    // and a checked one is read along with its record.
+    if (key_dir_entry.codec != kRaw || params_.verify_checksums) {
+        auto value = read_value(key, key_dir_entry, data_file);
+        if (!value) {
+            return {};
+        }
+        if (value->size() <= buffer.size()) {
+            std::memcpy(buffer.data(), value->data(), value->size());
+        }
+        sample.set_source(read_source(data_file, key_dir_entry));
+        return value->size();
+    }
+    sample.set_source(read_source(data_file, key_dir_entry));
+    if (key_dir_entry.value_size > buffer.size()) {
+        return key_dir_entry.value_size;
+    }
+    if (data_file->read_exact(key_dir_entry.value_offset, reinterpret_cast<uint8_t*>(buffer.data()),
+                              key_dir_entry.value_size) != key_dir_entry.value_size) {
+        sample.set_source(GetSource::kMiss);
         return {};
     }
+    if (value_cache_) {
+        value_cache_->insert(key, key_dir_entry, std::string_view(buffer.data(), key_dir_entry.value_size));
+    }
+    return key_dir_entry.value_size;
+}
 
-    return buffer;
+bool BitCaskImpl::get_with(const std::string& key, const std::function<void(std::string_view)>& fn) const {
+    // Values up to this size are read onto the stack when they are not mapped.
+    constexpr uint64_t kStackBufferSize = 4096;
+    GetLatencySample sample(stats_, params_.compaction_backoff_get_latency_usecs ? &get_latency_ : nullptr);
+
+    folly::rcu_reader guard;
+    auto ret = locate(key);
+    if (!ret) {
+        return false;
+    }
+    auto& [key_dir_entry, data_file] = ret.value();
+    if (value_cache_) {
+        if (auto cached = value_cache_->get(key, key_dir_entry)) {
+            sample.set_source(GetSource::kCache);
+            fn(*cached);
+            return true;
+        }
+    }
+    if (key_dir_entry.codec == kRaw && params_.verify_checksums) {
+        // A mapped record is checked and handed out in place.
+        auto header_size =
+            data_file->header_size(key_dir_entry.tstamp, key.size(), key_dir_entry.value_size) + key.size();
+        if (auto record =
+                data_file->mapped(key_dir_entry.value_offset - header_size, header_size + key_dir_entry.value_size)) {
+            if (!verify_record(key, key_dir_entry, data_file, record)) {
+                return false;
+            }
+            sample.set_source(GetSource::kMmap);
+            fn(std::string_view(reinterpret_cast<const char*>(record) + header_size, key_dir_entry.value_size));
+            return true;
+        }
+    }
+    if (key_dir_entry.codec != kRaw || params_.verify_checksums) {
+        auto value = read_value(key, key_dir_entry, data_file);
+        if (!value) {
+            return false;
+        }
+        sample.set_source(read_source(data_file, key_dir_entry));
+        fn(*value);
+        return true;
+    }
+    if (auto value = data_file->mapped(key_dir_entry.value_offset, key_dir_entry.value_size)) {
+        sample.set_source(GetSource::kMmap);
+        fn(std::string_view(reinterpret_cast<const char*>(value), key_dir_entry.value_size));
+        return true;
+    }
+
+    uint8_t stack_buffer[kStackBufferSize];
+    std::unique_ptr<uint8_t[]> heap_buffer;
+    auto buffer = stack_buffer;
+    if (key_dir_entry.value_size > kStackBufferSize) {
+        heap_buffer = std::make_unique<uint8_t[]>(key_dir_entry.value_size);
+        buffer = heap_buffer.get();
+    }
+    if (data_file->read_exact(key_dir_entry.value_offset, buffer, key_dir_entry.value_size) !=
+        key_dir_entry.value_size) {
+        return false;
+    }
+    std::string_view value(reinterpret_cast<const char*>(buffer), key_dir_entry.value_size);
+    if (value_cache_) {
+        value_cache_->insert(key, key_dir_entry, value);
+    }
+    sample.set_source(GetSource::kPread);
+    fn(value);
+    return true;
+}
+
+std::vector<std::optional<std::string>> BitCaskImpl::multi_get(std::span<const std::string> keys) const {
+    // Values closer than this are read with a single pread, the gap in between
+    // is the next record's header and key.
+    constexpr uint64_t kMaxReadGap = 4096;
+    constexpr uint64_t kMaxReadSize = 1024 * 1024;
+
+    struct Lookup {
+        size_t index;
+        KeyDirEntry entry;
+    };
+    struct ReadRange {
+        const DataFile* data_file;
+        uint64_t offset;
+        uint64_t size;
+        size_t begin;
+        size_t end;
+    };
+
+    std::vector<std::optional<std::string>> values(keys.size());
+    std::vector<Lookup> lookups;
+    std::vector<ReadRange> ranges;
+    std::vector<uint64_t> missing_files;
+    folly::rcu_reader guard;
+
+    // Where the read of a lookup starts, at its record when it is checked.
+    auto read_offset = [&](const Lookup& lookup, const DataFile* data_file) {
+        auto& entry = lookup.entry;
+        if (!params_.verify_checksums) {
+            return entry.value_offset;
+        }
+        auto key_size = keys[lookup.index].size();
+        return entry.value_offset - key_size - data_file->header_size(entry.tstamp, key_size, entry.value_size);
+    };
+
+    // Resolves all the entries and merges values that are close to each other
+    // in the same file. False if the lookups overlapped a multi-record batch
+    // or a compaction removed one of the files, then it is all done again.
+    auto resolve = [&]() {
+        auto version = apply_version_.load(std::memory_order_acquire);
+        if (version & 1) {
+            std::this_thread::yield();
+            return false;
+        }
+        lookups.clear();
+        ranges.clear();
+        std::fill(values.begin(), values.end(), std::nullopt);
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (auto ret = key_dir_.get(keys[i])) {
+                lookups.emplace_back(Lookup{i, ret.value()});
+            }
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (apply_version_.load(std::memory_order_relaxed) != version) {
+            return false;
+        }
+        // Keys still in a file that was missing on the previous try are misses.
+        std::erase_if(lookups, [&](const Lookup& lookup) {
+            return std::ranges::find(missing_files, lookup.entry.file_id) != missing_files.end();
+        });
+
+        // Serve what is cached and sort the rest in file order.
+        if (value_cache_) {
+            std::erase_if(lookups, [&](const Lookup& lookup) {
+                if (auto cached = value_cache_->get(keys[lookup.index], lookup.entry)) {
+                    values[lookup.index] = *cached;
+                    return true;
+                }
+                return false;
+            });
+        }
+        std::sort(lookups.begin(), lookups.end(), [](const Lookup& a, const Lookup& b) {
+            return std::tie(a.entry.file_id, a.entry.value_offset) < std::tie(b.entry.file_id, b.entry.value_offset);
+        });
+
+        for (size_t i = 0; i < lookups.size(); i++) {
+            auto& entry = lookups[i].entry;
+            auto same_file = !ranges.empty() && ranges.back().data_file->id() == entry.file_id;
+            auto data_file = same_file ? ranges.back().data_file : find_data_file(entry.file_id);
+            if (!data_file) {
+                missing_files.push_back(entry.file_id);
+                return false;
+            }
+            auto offset = read_offset(lookups[i], data_file);
+            if (same_file) {
+                auto& range = ranges.back();
+                auto range_end = range.offset + range.size;
+                auto new_end = std::max(range_end, entry.value_offset + entry.value_size);
+                if (offset <= range_end + kMaxReadGap && new_end - range.offset <= kMaxReadSize) {
+                    range.size = new_end - range.offset;
+                    range.end = i + 1;
+                    continue;
+                }
+            }
+            ranges.emplace_back(ReadRange{data_file, offset, entry.value_offset + entry.value_size - offset, i, i + 1});
+        }
+        return true;
+    };
+    while (!resolve()) {
+    }
+
+    // Copies the values of a range out of the buffer it was read into.
+    auto split_range = [&](const ReadRange& range, const uint8_t* buffer) {
+        for (auto i = range.begin; i < range.end; i++) {
+            auto& lookup = lookups[i];
+            if (params_.verify_checksums &&
+                !verify_record(keys[lookup.index], lookup.entry, range.data_file,
+                               buffer + (read_offset(lookup, range.data_file) - range.offset))) {
+                continue;
+            }
+            std::string_view stored(reinterpret_cast<const char*>(buffer) + (lookup.entry.value_offset - range.offset),
+                                    lookup.entry.value_size);
+            auto& value = values[lookup.index].emplace();
+            if (!value_codec_->decompress(lookup.entry.codec, stored, value)) {
+                values[lookup.index].reset();
+                continue;
+            }
+            if (value_cache_) {
+                value_cache_->insert(keys[lookup.index], lookup.entry, value);
+            }
+        }
+    };
+
+    auto read_range = [&](const ReadRange& range) {
+        if (range.end - range.begin == 1) {
+            auto& lookup = lookups[range.begin];
+            values[lookup.index] = read_value(keys[lookup.index], lookup.entry, range.data_file);
+            return;
+        }
+
+        auto buffer = std::make_unique<uint8_t[]>(range.size);
+        if (range.data_file->read_exact(range.offset, buffer.get(), range.size) != range.size) {
+            return;
+        }
+        split_range(range, buffer.get());
+    };
+
+    // With a backend that batches, submit the reads of all the ranges at
+    // once instead of spreading them over the read threads.
+    if (io_backend_->batches_reads() && ranges.size() > 1) {
+        std::vector<std::unique_ptr<uint8_t[]>> buffers(ranges.size());
+        std::vector<ReadOp> ops;
+        std::vector<size_t> op_ranges;
+        for (size_t i = 0; i < ranges.size(); i++) {
+            auto& range = ranges[i];
+            if (range.data_file->mapped(range.offset, range.size)) {
+                read_range(range);
+                continue;
+            }
+            buffers[i] = std::make_unique<uint8_t[]>(range.size);
+            ops.emplace_back(range.data_file->read_op(range.offset, buffers[i].get(), range.size));
+            op_ranges.emplace_back(i);
+        }
+        io_backend_->read_batch(ops);
+        for (size_t i = 0; i < ops.size(); i++) {
+            if (ops[i].result == static_cast<int64_t>(ops[i].size)) {
+                split_range(ranges[op_ranges[i]], buffers[op_ranges[i]].get());
+            }
+        }
+        return values;
+    }
+
+    if (!read_executor_ || ranges.size() <= 1) {
+        for (auto& range : ranges) {
+            read_range(range);
+        }
+        return values;
+    }
+
+    // Issue the reads in parallel and read the first range on this thread.
+    std::latch done(ranges.size() - 1);
+    for (size_t i = 1; i < ranges.size(); i++) {
+        read_executor_->add([&, i]() {
+            read_range(ranges[i]);
+            done.count_down();
+        });
+    }
+    read_range(ranges[0]);
+    done.wait();
+    return values;
+}
+
+CacheStats BitCaskImpl::cache_stats() const {
+    if (!value_cache_) {
+        return {};
+    }
+    return value_cache_->stats();
+}
+
+Stats BitCaskImpl::stats() const {
+    Stats stats;
+    stats.put_latency_nsecs = stats_.put_latency.snapshot();
+    for (auto& lane : lanes_) {
+        stats.write_queue_depth += std::max<ssize_t>(0, lane->queue.size());
+    }
+    stats.write_queue_depth_at_flush = stats_.write_queue_depth.snapshot();
+    stats.flush_batch_bytes = stats_.flush_batch_bytes.snapshot();
+    stats.flush_batch_records = stats_.flush_batch_records.snapshot();
+    stats.write_records_nsecs = stats_.write_records_latency.snapshot();
+    stats.get_cache_nsecs = stats_.get_cache_latency.snapshot();
+    stats.get_mmap_nsecs = stats_.get_mmap_latency.snapshot();
+    stats.get_pread_nsecs = stats_.get_pread_latency.snapshot();
+    stats.get_misses = stats_.get_misses.value();
+    stats.keys = key_dir_.size();
+    stats.key_dir_bytes = key_dir_.memory_usage();
+    stats.compaction_bytes_read = stats_.compaction_bytes_read.value();
+    stats.compaction_bytes_written = stats_.compaction_bytes_written.value();
+    stats.compaction_bytes_reclaimed = stats_.compaction_bytes_reclaimed.value();
+    stats.merges = stats_.merges.value();
+    stats.compaction_passes = stats_.compaction_passes.value();
+    stats.cache = cache_stats();
+    for (auto& [file_id, data_file] : data_files_) {
+        stats.data_files.emplace_back(DataFileStats{.file_id = file_id,
+                                                    .bytes = data_file->live_bytes() + data_file->dead_bytes(),
+                                                    .dead_bytes = data_file->dead_bytes(),
+                                                    .dead_ratio = data_file->dead_ratio(),
+                                                    .sealed = data_file->sealed()});
+    }
+    std::sort(stats.data_files.begin(), stats.data_files.end(),
+              [](const auto& a, const auto& b) { return a.file_id < b.file_id; });
+    return stats;
+}
+
+std::vector<std::pair<std::string, std::string>> BitCaskImpl::scan(const std::string& begin, const std::string& end,
+                                                                   uint64_t limit) const {
+    if (!ordered_index_) {
+        throw std::runtime_error("scan needs Params::ordered_index");
+    }
+    std::vector<std::pair<std::string, std::string>> result;
+    auto from = begin;
+    while (true) {
+        // multi_get sorts the reads by file and offset and merges nearby ones.
+        auto wanted = limit ? limit - result.size() : 0;
+        auto keys = ordered_index_->range(from, end, wanted);
+        auto values = multi_get(keys);
+        auto last_page = !limit || keys.size() < wanted;
+        if (!keys.empty()) {
+            from = keys.back() + '\0';
+        }
+        result.reserve(result.size() + keys.size());
+        for (size_t i = 0; i < keys.size(); i++) {
+            // Removed since the index was read.
+            if (values[i]) {
+                result.emplace_back(std::move(keys[i]), std::move(values[i].value()));
+            }
+        }
+        // Keys removed on the way leave the page short, read on past them.
+        if (last_page || result.size() == limit) {
+            return result;
+        }
+    }
+}
+
+bool BitCaskImpl::fold(const std::function<bool(std::string_view key, std::string_view value)>& fn) const {
+    // Reads of at least this size keep the disk streaming.
+    constexpr uint64_t kFoldReadSize = 8 * 1024 * 1024;
+
+    // Pin every file, compaction could otherwise move the live records of a
+    // file out of the way before the fold gets to them.
+    std::vector<std::shared_ptr<DataFile>> data_files;
+    {
+        std::lock_guard lock(merge_mutex_);
+        for (auto& [file_id, data_file] : data_files_) {
+            data_file->pin();
+            data_files.emplace_back(data_file);
+        }
+    }
+    std::sort(data_files.begin(), data_files.end(), [](const auto& a, const auto& b) { return a->id() < b->id(); });
+
+    bool ok = true;
+    bool stopped = false;
+    std::string value;
+    for (auto& data_file : data_files) {
+        if (stopped) {
+            break;
+        }
+        // Only a sealed file must be read up to its end. An active one may
+        // have a record half written, its records are always checked.
+        auto sealed = data_file->sealed();
+        auto size = data_file->size();
+        uint64_t valid_size = 0;
+        data_file->advise_sequential(true);
+        auto callback = [&](const DataRecordHeader& header, std::string_view key, std::string_view stored,
+                            uint64_t value_offset) {
+            if (header.tombstone) {
+                return true;
+            }
+            auto entry = key_dir_.get(key);
+            if (!entry || entry->file_id != data_file->id() || entry->value_offset != value_offset) {
+                return true;
+            }
+            if (header.codec != kRaw) {
+                if (!value_codec_->decompress(header.codec, stored, value)) {
+                    ok = false;
+                    return true;
+                }
+                stored = value;
+            }
+            stopped = !fn(key, stored);
+            return !stopped;
+        };
+        if (!data_file->scan_records(true /* read_values */, params_.verify_checksums || !sealed, callback,
+                                     &valid_size, kFoldReadSize) ||
+            (sealed && !stopped && valid_size < size)) {
+            std::cout << "fold could not read data file " << data_file->id() << " through" << std::endl;
+            ok = false;
+        }
+        data_file->advise_sequential(false);
+    }
+    for (auto& data_file : data_files) {
+        data_file->unpin();
+    }
+    return ok;
 }
 
 std::future<bool> BitCaskImpl::remove(const std::string& key) {
-    std::shared_lock lock(io_mutex_);
     auto ret = key_dir_.get(key);
     if (!ret) {
         std::promise<bool> p;
@@ -181,115 +1129,646 @@ std::future<bool> BitCaskImpl::remove(const std::string& key) {
     return put(key, {}, true /* tombstone */);
 }
 
-void BitCaskImpl::create_new_data_file(bool init) {
-    std::lock_guard lock(file_mutex_);
-    if (!init) {
-        auto& data_file = data_files_.at(last_file_id_.load());
-        if (data_file->size() < params_.max_data_file_size) {
-            return;
+std::optional<uint64_t> BitCaskImpl::next_file_id() {
+    auto file_id = ++last_file_id_;
+    if (file_id > UINT32_MAX) {
+        std::cout << "Data file ids exhausted" << std::endl;
+        return std::nullopt;
+    }
+    return file_id;
+}
+
+bool BitCaskImpl::create_new_data_file(WriteLane& lane) {
+    // Lanes share the id space, each new file takes the next id. The new file
+    // is ready before the old one is sealed, so on failure the lane keeps
+    // writing to the old one.
+    auto new_file_id = next_file_id();
+    if (!new_file_id) {
+        return false;
+    }
+    std::cout << "Create new data file " << *new_file_id << std::endl;
+    std::shared_ptr<DataFile> data_file;
+    try {
+        data_file = std::make_shared<DataFile>(data_file_path(*new_file_id), *new_file_id, true /* write */, io_backend_);
+    } catch (const std::runtime_error& e) {
+        std::cout << "Failed to create data file " << *new_file_id << ": " << e.what() << std::endl;
+        return false;
+    }
+    if (!sync_parent_dir(data_file->name())) {
+        std::cout << "Failed to sync the data directory for data file " << *new_file_id << std::endl;
+        std::error_code ec;
+        fs::remove(data_file->name(), ec);
+        return false;
+    }
+
+    if (lane.active_data_file) {
+        if (!lane.active_data_file->seal(hint_file_path(lane.active_data_file->id()))) {
+            std::cout << "Failed to seal data file " << lane.active_data_file->id() << std::endl;
+            lane.seal_failed = true;
+        }
+        if (params_.mmap_reads) {
+            lane.active_data_file->map();
+        }
+    }
+    lane.active_data_file = std::move(data_file);
+    data_files_.insert(*new_file_id, lane.active_data_file);
+    return true;
+}
+
+std::string BitCaskImpl::data_file_path(uint64_t file_id) const {
+    return (fs::path(data_dir_) / std::format("{:09}.data", file_id)).string();
+}
+
+std::string BitCaskImpl::hint_file_path(uint64_t file_id) const {
+    return (fs::path(data_dir_) / std::format("{:09}.hint", file_id)).string();
+}
+
+bool BitCaskImpl::load_data_file(const std::shared_ptr<DataFile>& data_file, std::vector<HintRecord>& records,
+                                 bool recovering) {
+    auto hint_path = hint_file_path(data_file->id());
+    if (fs::exists(hint_path)) {
+        // A hint pointing past the end of the data file is from a data file
+        // that did not make it to disk, scan the data file instead.
+        auto data_size = data_file->size();
+        bool valid = true;
+        auto callback = [&](const HintRecordHeader& header, std::string_view key) {
+            valid &= header.value_offset + header.value_size <= data_size;
+            records.emplace_back(HintRecord{.key = std::string(key),
+                                            .timestamp = header.timestamp,
+                                            .value_size = header.value_size,
+                                            .value_offset = header.value_offset,
+                                            .tombstone = header.tombstone,
+                                            .codec = header.codec});
+        };
+        if (HintFile::read_all(hint_path, callback) && valid) {
+            return true;
         }
+        std::cout << "Ignoring invalid hint file " << hint_path << std::endl;
+        records.clear();
+    }
+
+    // Scan the keys of the data file, and at open write the missing hint file.
+    std::unique_ptr<HintFile> hint_file;
+    if (recovering) {
+        hint_file = std::make_unique<HintFile>(hint_path + ".tmp");
     }
-    auto new_file_id = last_file_id_.load() + 1;
-    fs::path path = fs::path(data_dir_) / std::format("{:09}.data", new_file_id);
-    std::cout << "Create new data file " << new_file_id << std::endl;
-    data_files_.insert(new_file_id, std::make_shared<DataFile>(path.string(), new_file_id, true /* write */));
-    last_file_id_++;
-    active_data_file_ = data_files_.at(last_file_id_);
+    auto callback = [&](const DataRecordHeader& header, std::string_view key, std::string_view, uint64_t value_offset) {
+        records.emplace_back(HintRecord{.key = std::string(key),
+                                        .timestamp = header.timestamp,
+                                        .value_size = header.value_size,
+                                        .value_offset = value_offset,
+                                        .tombstone = header.tombstone,
+                                        .codec = header.codec});
+        if (!hint_file) {
+            return true;
+        }
+        hint_file->append(records.back().key, HintRecordHeader{.timestamp = header.timestamp,
+                                                               .value_offset = value_offset,
+                                                               .key_size = header.key_size,
+                                                               .value_size = header.value_size,
+                                                               .tombstone = header.tombstone,
+                                                               .codec = header.codec});
+        return hint_file->flush();
+    };
+    // Records are checked on the way. Only a file that was still being
+    // written when the store stopped can end in a torn record, at open that
+    // tail is cut off. A bad record anywhere else fails the load with the
+    // records before it, nothing after it can be trusted to start a record.
+    uint64_t valid_size = 0;
+    if (!data_file->scan_records(false /* read_values */, true /* verify */, callback, &valid_size)) {
+        return false;
+    }
+    if (valid_size < data_file->size()) {
+        if (!recovering || data_file->marked_sealed()) {
+            std::cout << "Damaged record at offset " << valid_size << " of " << data_file->name() << std::endl;
+            return false;
+        }
+        std::cout << "Truncating " << data_file->name() << " to " << valid_size << " bytes after a torn record"
+                  << std::endl;
+        if (!data_file->truncate(valid_size)) {
+            return false;
+        }
+    }
+    return !hint_file || hint_file->finish(hint_path);
 }
 
 void BitCaskImpl::load_all_data_files() {
-    // Load all data files in order.
-    std::set<uint64_t> file_ids;
+    std::set<uint64_t> file_id_set;
     for (auto& [file_id, _] : data_files_) {
-        file_ids.insert(file_id);
+        file_id_set.insert(file_id);
+    }
+    std::vector<uint64_t> file_ids(file_id_set.begin(), file_id_set.end());
+    if (file_ids.empty()) {
+        return;
     }
 
-    for (auto& file_id : file_ids) {
-        auto& data_file = data_files_.at(file_id);
-        auto callback = [this, file_id](const DataRecordHeader& header, const DataRecord& record) {
-            KeyDirEntry entry{.file_id = file_id, .value_size = header.value_size, .value_offset = record.value_offset};
-            key_dir_.insert(record.key, entry);
-        };
-        std::cout << "Loading data file " << file_id << std::endl;
-        data_file->read_all_records(callback);
+    uint64_t num_threads = params_.load_threads ? params_.load_threads : std::thread::hardware_concurrency();
+    num_threads = std::max<uint64_t>(1, std::min<uint64_t>(num_threads, file_ids.size()));
+
+    // Loaders read files (in file id order) into per-file partial maps, split
+    // by key hash. Each applier owns one partition of the key space and
+    // applies it file by file in file id order, so the last write of a key
+    // still wins while the KeyDir is filled from all threads at once.
+    std::vector<std::vector<std::vector<HintRecord>>> partitions(file_ids.size());
+    std::vector<bool> loaded(file_ids.size(), false);
+    std::mutex mutex;
+    std::condition_variable loaded_cv;
+    std::atomic<size_t> next_file = 0;
+    std::atomic<uint64_t> max_seq = 0;
+    std::vector<std::shared_ptr<DataFile>> data_files;
+    for (auto file_id : file_ids) {
+        data_files.emplace_back(data_files_.at(file_id));
+    }
+
+    auto load_worker = [&]() {
+        while (true) {
+            auto index = next_file++;
+            if (index >= file_ids.size()) break;
+
+            auto file_id = file_ids[index];
+            std::vector<HintRecord> records;
+            std::cout << "Loading data file " << file_id << std::endl;
+            auto& data_file = data_files[index];
+            if (!load_data_file(data_file, records, true /* recovering */)) {
+                std::cout << "Failed to load data file " << file_id << std::endl;
+            }
+            uint64_t bytes = 0;
+            uint64_t file_max_seq = 0;
+            for (auto& record : records) {
+                bytes += data_file->record_size(record.timestamp, record.key.size(), record.value_size);
+                data_file->add_seq(record.timestamp);
+                file_max_seq = std::max(file_max_seq, record.timestamp);
+            }
+            data_file->add_records(records.size(), bytes);
+            auto seq = max_seq.load();
+            while (file_max_seq > seq && !max_seq.compare_exchange_weak(seq, file_max_seq)) {
+            }
+            std::vector<std::vector<HintRecord>> file_partitions(num_threads);
+            for (auto& record : records) {
+                file_partitions[std::hash<std::string>{}(record.key) % num_threads].emplace_back(std::move(record));
+            }
+
+            {
+                std::lock_guard lock(mutex);
+                partitions[index] = std::move(file_partitions);
+                loaded[index] = true;
+            }
+            loaded_cv.notify_all();
+        }
+    };
+
+    auto apply_worker = [&](uint64_t partition) {
+        // Lanes interleave their files, so a file may hold records older than
+        // the ones applied before it. The sequence number decides which write
+        // of a key wins. Records of older files have none and keep file order.
+        std::unordered_map<std::string, uint64_t> removed_seqs;
+        for (size_t index = 0; index < file_ids.size(); index++) {
+            std::vector<HintRecord> records;
+            {
+                std::unique_lock lock(mutex);
+                loaded_cv.wait(lock, [&] { return loaded[index]; });
+                records = std::move(partitions[index][partition]);
+            }
+            // Rebuild the dead counts as records overwrite each other.
+            for (auto& record : records) {
+                auto current = key_dir_.get(record.key);
+                bool superseded = current && current->tstamp > record.timestamp;
+                std::optional<KeyDirEntry> previous;
+                if (record.tombstone) {
+                    data_files[index]->add_tombstones(
+                        1, data_files[index]->record_size(record.timestamp, record.key.size(), 0));
+                    if (superseded) {
+                        continue;
+                    }
+                    previous = key_dir_.remove(record.key);
+                    if (previous && ordered_index_) {
+                        ordered_index_->remove(record.key);
+                    }
+                    if (record.timestamp) {
+                        auto& removed_seq = removed_seqs[record.key];
+                        removed_seq = std::max(removed_seq, record.timestamp);
+                    }
+                } else {
+                    auto removed = removed_seqs.find(record.key);
+                    if (superseded || (removed != removed_seqs.end() && removed->second > record.timestamp)) {
+                        data_files[index]->add_dead_records(
+                            1, data_files[index]->record_size(record.timestamp, record.key.size(), record.value_size));
+                        continue;
+                    }
+                    KeyDirEntry entry{.file_id = file_ids[index],
+                                      .value_size = record.value_size,
+                                      .value_offset = record.value_offset,
+                                      .tstamp = record.timestamp,
+                                      .codec = record.codec};
+                    previous = key_dir_.insert(record.key, entry);
+                    if (!previous && ordered_index_) {
+                        ordered_index_->insert(record.key);
+                    }
+                }
+                if (previous) {
+                    mark_dead(record.key.size(), previous.value());
+                }
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (uint64_t i = 0; i < num_threads; i++) {
+        threads.emplace_back(load_worker);
+        threads.emplace_back(apply_worker, i);
+    }
+    for (auto& thread : threads) {
+        thread.join();
     }
+    next_seq_ = max_seq.load() + 1;
 }
 
 void BitCaskImpl::compact_worker() {
-    while (true) {
-        if (stop_.load()) break;
-
+    while (!stop_.load()) {
         compact();
-        std::this_thread::sleep_for(std::chrono::seconds(params_.compaction_interval_secs));
+        stats_.compaction_passes.add();
+        std::unique_lock lock(compact_mutex_);
+        compact_cv_.wait_for(lock, std::chrono::seconds(params_.compaction_interval_secs), [&] { return stop_.load(); });
+    }
+}
+
+void BitCaskImpl::stats_worker() {
+    // Shares the stop wake-up of compaction.
+    std::unique_lock lock(compact_mutex_);
+    while (!compact_cv_.wait_for(lock, std::chrono::seconds(params_.stats_export_interval_secs),
+                                 [&] { return stop_.load(); })) {
+        lock.unlock();
+        params_.stats_exporter(stats());
+        lock.lock();
+    }
+}
+
+void BitCaskImpl::set_compaction_rate(uint64_t bytes_per_sec) { compaction_limiter_.set_rate(bytes_per_sec); }
+
+void BitCaskImpl::pause_compaction() {
+    std::lock_guard lock(compact_mutex_);
+    compaction_paused_ = true;
+}
+
+void BitCaskImpl::resume_compaction() {
+    {
+        std::lock_guard lock(compact_mutex_);
+        compaction_paused_ = false;
     }
+    compact_cv_.notify_all();
+}
+
+bool BitCaskImpl::compaction_resumed() {
+    std::unique_lock lock(compact_mutex_);
+    compact_cv_.wait(lock, [&] { return !compaction_paused_ || stop_.load(); });
+    return !stop_.load();
+}
+
+bool BitCaskImpl::foreground_busy() const {
+    if (params_.compaction_backoff_queue_depth) {
+        uint64_t queued = 0;
+        for (auto& lane : lanes_) {
+            queued += std::max<ssize_t>(0, lane->queue.size());
+        }
+        if (queued >= params_.compaction_backoff_queue_depth) {
+            return true;
+        }
+    }
+    if (!params_.compaction_backoff_get_latency_usecs) {
+        return false;
+    }
+    // An average nobody updated for a while says nothing about current gets.
+    constexpr auto kMaxSampleAge = std::chrono::seconds(1);
+    auto updated_at = std::chrono::steady_clock::time_point(
+        std::chrono::steady_clock::duration(get_latency_.updated_at.load(std::memory_order_relaxed)));
+    return std::chrono::steady_clock::now() - updated_at < kMaxSampleAge &&
+           get_latency_.nsecs.load(std::memory_order_relaxed) >= params_.compaction_backoff_get_latency_usecs * 1000;
+}
+
+bool BitCaskImpl::throttle_compaction(uint64_t bytes) {
+    // Back off while foreground work is suffering, but only for so long per
+    // request so compaction still makes progress under sustained load.
+    constexpr auto kMaxBackoff = std::chrono::seconds(1);
+    constexpr auto kBackoffStep = std::chrono::milliseconds(10);
+    auto deadline = std::chrono::steady_clock::now() + kMaxBackoff;
+    while (foreground_busy() && std::chrono::steady_clock::now() < deadline) {
+        std::unique_lock lock(compact_mutex_);
+        if (compact_cv_.wait_for(lock, kBackoffStep, [&] { return stop_.load(); })) {
+            return false;
+        }
+    }
+    return compaction_limiter_.request(bytes);
 }
 
 void BitCaskImpl::compact() {
-    auto last_file_id = last_file_id_.load();
-    std::vector<std::shared_ptr<DataFile>> non_active_files;
+    // Files below this much live data are merged together.
+    uint64_t merge_threshold = params_.merge_min_data_file_ratio * params_.max_data_file_size;
+
+    std::vector<std::shared_ptr<DataFile>> sealed_files;
     for (auto& [file_id, data_file] : data_files_) {
-        if (file_id != last_file_id) {
-            non_active_files.emplace_back(data_file);
+        if (data_file->sealed() && !data_file->pinned()) {
+            sealed_files.emplace_back(data_file);
+        }
+    }
+    std::sort(sealed_files.begin(), sealed_files.end(),
+              [](const auto& a, const auto& b) { return a->id() < b->id(); });
+
+    // Group small files in id order, each group fits into one data file.
+    std::vector<std::shared_ptr<DataFile>> group;
+    std::vector<std::shared_ptr<DataFile>> garbage_files;
+    uint64_t group_bytes = 0;
+    auto merge_group = [&]() {
+        // A file alone is only rewritten for garbage beyond its tombstones,
+        // which it may have to keep and would then rewrite forever.
+        if (group.size() > 1 || (group.size() == 1 && group[0]->garbage_bytes())) {
+            if (!compaction_resumed()) {
+                return false;
+            }
+            merge_data_files(group);
+        }
+        group.clear();
+        group_bytes = 0;
+        return true;
+    };
+    for (auto& data_file : sealed_files) {
+        auto live = data_file->live_bytes();
+        if (live < merge_threshold) {
+            if (group_bytes + live > params_.max_data_file_size && !merge_group()) {
+                return;
+            }
+            group.emplace_back(data_file);
+            group_bytes += live;
+        } else if (data_file->garbage_ratio() >= params_.compact_dead_ratio) {
+            garbage_files.emplace_back(data_file);
         }
     }
+    if (!merge_group()) {
+        return;
+    }
 
-    for (auto& data_file : non_active_files) {
-        compact_data_file(data_file);
+    // Larger files are only rewritten once enough of them is garbage, the
+    // ones that free the most space first.
+    std::sort(garbage_files.begin(), garbage_files.end(),
+              [](const auto& a, const auto& b) { return a->garbage_bytes() > b->garbage_bytes(); });
+    for (auto& data_file : garbage_files) {
+        if (!compaction_resumed()) return;
+        merge_data_files({data_file});
     }
 }
 
-void BitCaskImpl::compact_data_file(std::shared_ptr<DataFile> orig_data_file) {
-    // Compact the original data file to new data file.
-    std::vector<std::pair<std::string, KeyDirEntry>> new_key_entries;
-    fs::path path = fs::path(data_dir_) / std::format("{:05}.data.tmp", orig_data_file->id());
-    auto new_data_file = std::make_shared<DataFile>(path.string(), orig_data_file->id(), true /* write */);
-    uint64_t record_count = 0;
-    auto callback = [&](const DataRecordHeader& header, const DataRecord& record) {
-        auto ret = key_dir_.get(record.key);
-        if (!ret) {
-            // Ignore if key not found in key dir
-            return;
+void BitCaskImpl::merge_data_files(const std::vector<std::shared_ptr<DataFile>>& inputs) {
+    // Runs are copied in pieces of at most this size, to pace them evenly.
+    constexpr uint64_t kMaxRunSize = 1024 * 1024;
+    struct Relocation {
+        std::string key;
+        KeyDirEntry old_entry;
+        KeyDirEntry new_entry;
+    };
+
+    // A fold may have pinned an input since the inputs were picked.
+    std::set<uint64_t> input_ids;
+    {
+        std::lock_guard merge_lock(merge_mutex_);
+        for (auto& input : inputs) {
+            if (input->pinned()) {
+                return;
+            }
+            input_ids.insert(input->id());
         }
-        auto key_dir_entry = ret.value();
-        if (orig_data_file->id() != key_dir_entry.file_id || record.value_offset != key_dir_entry.value_offset) {
-            // Ignore if file id or offset doesnt match, it will be stale value.
+    }
+    // A tombstone can only be dropped along with its input file, and only
+    // when no other file may hold an older put of its key. Otherwise a crash
+    // that leaves that file behind brings the put back at the next open. The
+    // inputs are unlinked in no particular order, so the other inputs count
+    // too. Records without sequence numbers go by file id.
+    struct OtherFiles {
+        uint64_t oldest_id = UINT64_MAX;
+        uint64_t min_seq = UINT64_MAX;
+    };
+    std::unordered_map<uint64_t, OtherFiles> other_files;
+    for (auto& input : inputs) {
+        auto& others = other_files[input->id()];
+        for (auto& [file_id, data_file] : data_files_) {
+            if (file_id != input->id()) {
+                others.oldest_id = std::min(others.oldest_id, file_id);
+                others.min_seq = std::min(others.min_seq, data_file->min_seq());
+            }
+        }
+    }
+
+    // Live records are found from the hint entries and copied over in runs
+    // of adjacent records, without decoding them. The output takes a new id,
+    // so a file id always names the same file and lock-free readers holding
+    // an entry of an input never read the output instead.
+    auto next_id = next_file_id();
+    if (!next_id) {
+        return;
+    }
+    auto output_id = *next_id;
+    auto output = std::make_shared<DataFile>(data_file_path(output_id) + ".tmp", output_id, true /* write */, io_backend_);
+    std::vector<Relocation> relocations;
+    uint64_t record_count = 0;
+    for (auto& input : inputs) {
+        std::vector<HintRecord> hints;
+        if (!load_data_file(input, hints, false /* recovering */)) {
+            std::cout << "Failed to read data file " << input->id() << " for compaction" << std::endl;
             return;
         }
 
-        std::vector<DataRecord> records{record};
-        if (!new_data_file->write_records(records)) {
-            throw std::runtime_error("Compaction failed");
+        auto& others = other_files[input->id()];
+        std::vector<HintRecord> run;
+        std::vector<std::optional<KeyDirEntry>> old_entries;
+        uint64_t run_offset = 0;
+        uint64_t run_size = 0;
+        auto copy_run = [&]() {
+            if (run.empty()) {
+                return true;
+            }
+            // Both the read and the write of the run count against the limit.
+            if (!throttle_compaction(2 * run_size)) {
+                return false;
+            }
+            if (!output->copy_records(*input, run_offset, run_size, run, params_.compaction_kernel_copy)) {
+                throw std::runtime_error("Compaction failed");
+            }
+            stats_.compaction_bytes_read.add(run_size);
+            stats_.compaction_bytes_written.add(run_size);
+            for (size_t i = 0; i < run.size(); i++) {
+                if (!old_entries[i]) {
+                    output->add_tombstones(1, output->record_size(run[i].timestamp, run[i].key.size(), 0));
+                } else {
+                    KeyDirEntry entry{.file_id = output_id,
+                                      .value_size = run[i].value_size,
+                                      .value_offset = run[i].value_offset,
+                                      .tstamp = run[i].timestamp,
+                                      .codec = run[i].codec};
+                    relocations.emplace_back(Relocation{std::move(run[i].key), old_entries[i].value(), entry});
+                }
+            }
+            record_count += run.size();
+            run.clear();
+            old_entries.clear();
+            run_size = 0;
+            return true;
+        };
+
+        // Writes a record in the output's format, with its value decompressed
+        // and compressed again with the current codec. A value that does not
+        // decode is kept as it is. False if it could not be read.
+        auto rewrite = [&](HintRecord& hint, const std::optional<KeyDirEntry>& old_entry) {
+            std::vector<DataRecord> records(1);
+            auto& record = records[0];
+            record.key = hint.key;
+            record.tombstone = hint.tombstone;
+            record.seq = hint.timestamp;
+            if (!hint.tombstone) {
+                std::string stored(hint.value_size, '\0');
+                std::string value;
+                if (input->read_exact(hint.value_offset, reinterpret_cast<uint8_t*>(stored.data()), stored.size()) !=
+                    stored.size()) {
+                    return false;
+                }
+                stats_.compaction_bytes_read.add(stored.size());
+                if (!value_codec_->decompress(hint.codec, stored, value)) {
+                    std::cout << "Failed to decode a value in data file " << input->id() << std::endl;
+                    record.codec = hint.codec;
+                    record.value = std::move(stored);
+                } else {
+                    record.codec = value_codec_->compress(value, record.value);
+                    if (record.codec == kRaw) {
+                        record.value = std::move(value);
+                    }
+                }
+            }
+            if (!output->write_records(records)) {
+                throw std::runtime_error("Compaction failed");
+            }
+            stats_.compaction_bytes_written.add(output->record_size(record.seq, record.key.size(), record.value.size()));
+            record_count++;
+            if (!old_entry) {
+                output->add_tombstones(1, output->record_size(record.seq, record.key.size(), 0));
+                return true;
+            }
+            KeyDirEntry entry{.file_id = output_id,
+                              .value_size = record.value.size(),
+                              .value_offset = record.value_offset,
+                              .tstamp = record.seq,
+                              .codec = record.codec};
+            relocations.emplace_back(Relocation{std::move(hint.key), old_entry.value(), entry});
+            return true;
+        };
+
+        for (auto& hint : hints) {
+            auto ret = key_dir_.get(hint.key);
+            std::optional<KeyDirEntry> old_entry;
+            if (hint.tombstone) {
+                auto droppable = hint.timestamp ? hint.timestamp <= others.min_seq : input->id() < others.oldest_id;
+                if (ret || droppable) {
+                    continue;
+                }
+            } else {
+                // Skip values that have been overwritten or removed since.
+                if (!ret || ret->file_id != input->id() || ret->value_offset != hint.value_offset) {
+                    continue;
+                }
+                old_entry = ret;
+            }
+
+            // Records of older format files, and values the current codec
+            // would store differently, are rewritten instead of copied.
+            auto size = input->record_size(hint.timestamp, hint.key.size(), hint.value_size);
+            auto same_format = input->format() == output->format();
+            if (!same_format || (old_entry && value_codec_->stale(hint.codec, hint.value_size))) {
+                if (!copy_run() || !throttle_compaction(2 * size) || !rewrite(hint, old_entry)) {
+                    fs::remove(output->name());
+                    return;
+                }
+                continue;
+            }
+            auto offset = hint.value_offset - hint.key.size() - input->header_size(hint.timestamp, hint.key.size(),
+                                                                                   hint.value_size);
+            if ((offset != run_offset + run_size || run_size >= kMaxRunSize) && !copy_run()) {
+                fs::remove(output->name());
+                return;
+            }
+            if (run.empty()) {
+                run_offset = offset;
+            }
+            run_size += size;
+            run.emplace_back(std::move(hint));
+            old_entries.emplace_back(old_entry);
         }
+        if (!copy_run()) {
+            fs::remove(output->name());
+            return;
+        }
+    }
 
-        record_count++;
-        KeyDirEntry entry{.file_id = new_data_file->id(),
-                          .value_size = record.value.size(),
-                          .value_offset = records[0].value_offset};
-        new_key_entries.emplace_back(record.key, std::move(entry));
-    };
+    // The copy runs without merge_mutex_, so a fold can pin an input in the
+    // meantime, the output is then dropped. Held through the publish, a fold
+    // finds either all the inputs or the output.
+    std::lock_guard merge_lock(merge_mutex_);
+    if (std::any_of(inputs.begin(), inputs.end(), [](const auto& input) { return input->pinned(); })) {
+        fs::remove(output->name());
+        return;
+    }
+    std::cout << "Merged " << inputs.size() << " data files into " << output_id << std::endl;
 
-    auto ret = orig_data_file->read_all_records(callback);
-    assert(ret);
+    // Publish the output before pointing the KeyDir at it. Readers never
+    // block, a lookup that still finds an input reads the same value there.
+    uint64_t input_bytes = 0;
+    for (auto& input : inputs) {
+        input_bytes += input->size();
+    }
+    auto output_bytes = record_count ? output->size() : 0;
+    stats_.compaction_bytes_reclaimed.add(input_bytes > output_bytes ? input_bytes - output_bytes : 0);
+    stats_.merges.add();
 
-    // Take exclusive lock to atomically update the keydir and new data file.
-    std::unique_lock lock(io_mutex_);
+    auto hint_path = hint_file_path(output_id);
     if (record_count == 0) {
-        // Remove the data file if all the entries are stale.
-        data_files_.erase(orig_data_file->id());
-        orig_data_file.reset();
-        new_data_file.reset();
-        fs::remove(orig_data_file->name());
-        fs::remove(new_data_file->name());
-        return;
+        fs::remove(output->name());
+    } else {
+        // A crash before the hint is in place falls back to scanning the data file.
+        if (!output->seal(hint_path + ".tmp")) {
+            throw std::runtime_error("Compaction failed");
+        }
+        output->rename(data_file_path(output_id));
+        fs::rename(hint_path + ".tmp", hint_path);
+        if (!sync_parent_dir(hint_path)) {
+            throw std::runtime_error("Compaction failed");
+        }
+        if (params_.mmap_reads) {
+            output->map();
+        }
+        data_files_.insert(output_id, output);
+        for (auto& [key, old_entry, new_entry] : relocations) {
+            if (!key_dir_.update_if(key, old_entry, new_entry)) {
+                // Written again while the merge ran.
+                output->add_dead_records(1, output->record_size(new_entry.tstamp, key.size(), new_entry.value_size));
+            } else if (value_cache_) {
+                value_cache_->relocate(key, old_entry, new_entry);
+            }
+        }
     }
 
-    // Rename the new compact tmp data file to original data file.
-    fs::rename(new_data_file->name(), orig_data_file->name());
-    data_files_.insert_or_assign(new_data_file->id(), new_data_file);
-    // Update the key entries with latest value offsets
-    for (auto& [key, entry] : new_key_entries) {
-        key_dir_.insert(key, entry);
+    // The output replaces the inputs only once it is in place, so a crash
+    // before this leaves duplicates of older records and not lost ones. The
+    // inputs are closed and unlinked once no reader can still be using them.
+    for (auto& input : inputs) {
+        data_files_.erase(input->id());
     }
+    auto retired = new std::vector<std::shared_ptr<DataFile>>(inputs);
+    folly::rcu_retire(retired, [](std::vector<std::shared_ptr<DataFile>>* retired) {
+        for (auto& input : *retired) {
+            for (auto path : {fs::path(input->name()).replace_extension(".hint"), fs::path(input->name())}) {
+                std::error_code ec;
+                if (!fs::remove(path, ec) && ec) {
+                    std::cout << "Failed to remove " << path.string() << ": " << ec.message() << std::endl;
+                }
+            }
+        }
+        delete retired;
+    });
 }
 
 }  // namespace bitcask
\ No newline at end of file
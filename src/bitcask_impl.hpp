@@ -22,8 +22,14 @@ THE SOFTWARE.
 
 #pragma once
 #include <folly/MPMCQueue.h>
+#include <folly/concurrency/ConcurrentHashMap.h>
+#include <folly/executors/CPUThreadPoolExecutor.h>
+#include <folly/synchronization/Rcu.h>
 
+#include <chrono>
+#include <condition_variable>
 #include <future>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <unordered_map>
@@ -31,14 +37,86 @@ THE SOFTWARE.
 
 #include "bitcask.hpp"
 #include "key_dir.hpp"
+#include "ordered_index.hpp"
+#include "rate_limiter.hpp"
+#include "stats.hpp"
 #include "storage.hpp"
+#include "value_cache.hpp"
+#include "value_codec.hpp"
 namespace bitcask {
 
+// Orders a WriteBatch whose keys belong to more than one lane. Each of the
+// other lanes it writes stops at a barrier once what it queued before the
+// batch is written, and waits there until the batch is written too.
+struct WriteFence {
+    std::mutex mutex;
+    std::condition_variable cv;
+    // Other lanes not yet stopped at their barrier.
+    size_t lanes_pending = 0;
+    bool written = false;
+};
+
+// A put, a remove or a whole WriteBatch, completed by a single promise.
 struct KVQueueEntry {
-    std::string key;
-    std::string value;
-    bool tombstone;
+    std::vector<DataRecord> records;
     std::promise<bool> flush_promise;
+    std::chrono::steady_clock::time_point enqueued_at;
+    // Set for a WriteBatch whose keys belong to more than one lane, and for
+    // the barriers it queues on the other lanes, which have no records.
+    std::shared_ptr<WriteFence> fence;
+};
+
+// Group of records collected by the flush thread and written by the write
+// thread in a single write_records call. Two of these are ping-ponged so the
+// next batch fills while the current one is being written.
+struct FlushBatch {
+    std::vector<DataRecord> records;
+    std::vector<std::promise<bool>> promises;
+    // When the write of each promise was queued.
+    std::vector<std::chrono::steady_clock::time_point> enqueued_at;
+    uint64_t size = 0;
+    // Set when the batch carries a multi-record WriteBatch, whose KeyDir
+    // updates must become visible all at once.
+    bool atomic = false;
+    // Set when the batch carries a WriteBatch spanning lanes, released once
+    // it is written.
+    std::shared_ptr<WriteFence> fence;
+
+    bool empty() const { return records.empty(); }
+    void clear() {
+        records.clear();
+        promises.clear();
+        enqueued_at.clear();
+        size = 0;
+        atomic = false;
+        fence.reset();
+    }
+};
+
+// One write path: the puts of a share of the keys are queued, batched by the
+// flush thread and appended to the lane's own active file by its write thread.
+struct WriteLane {
+    folly::MPMCQueue<std::shared_ptr<KVQueueEntry>> queue{65536};
+    std::shared_ptr<DataFile> active_data_file;
+    // Hand-off slot between the flush (collector) thread and the write thread.
+    std::mutex batch_mutex;
+    std::condition_variable batch_cv;
+    FlushBatch pending_batch;
+    bool pending_ready = false;
+    bool writer_busy = false;
+    bool flush_done = false;
+    // Set by the write thread when sealing a file failed, the writes still
+    // waiting for a sync may not be on disk.
+    bool seal_failed = false;
+    std::thread flush_thread;
+    std::thread write_thread;
+};
+
+// Moving average of sampled get latencies.
+struct LatencyAverage {
+    std::atomic<uint64_t> nsecs = 0;
+    // steady_clock ticks of the last sample.
+    std::atomic<int64_t> updated_at = 0;
 };
 
 class BitCaskImpl {
@@ -48,31 +126,115 @@ class BitCaskImpl {
 
     std::future<bool> put(const std::string& key, const std::string& value, bool tombstone = false);
     std::optional<std::string> get(const std::string& key) const;
+    folly::SemiFuture<std::optional<std::string>> get_async(const std::string& key) const;
+    std::optional<uint64_t> get_into(const std::string& key, std::span<char> buffer) const;
+    bool get_with(const std::string& key, const std::function<void(std::string_view)>& fn) const;
+    std::vector<std::optional<std::string>> multi_get(std::span<const std::string> keys) const;
     std::future<bool> remove(const std::string& key);
+    std::vector<std::pair<std::string, std::string>> scan(const std::string& begin, const std::string& end,
+                                                          uint64_t limit) const;
+    bool fold(const std::function<bool(std::string_view key, std::string_view value)>& fn) const;
+    std::future<bool> write(WriteBatch&& batch);
+    CacheStats cache_stats() const;
+    Stats stats() const;
+    void set_compaction_rate(uint64_t bytes_per_sec);
+    void pause_compaction();
+    void resume_compaction();
 
    private:
+    std::future<bool> enqueue(std::shared_ptr<KVQueueEntry> entry);
     void init();
-    void create_new_data_file(bool init);
+    WriteLane& lane_for(const std::string& key);
+    // Looks up key and the file holding its value without locking. Must be
+    // called within an RCU read section, which keeps the file alive.
+    std::optional<std::pair<KeyDirEntry, const DataFile*>> locate(const std::string& key) const;
+    // The data file with file_id, nullptr if compaction has removed it.
+    const DataFile* find_data_file(uint64_t file_id) const;
+    // Checks the CRC32C of the record of key at entry, read into record.
+    bool verify_record(const std::string& key, const KeyDirEntry& entry, const DataFile* data_file,
+                       const uint8_t* record) const;
+    // Reads and decompresses the value at entry and adds it to the cache.
+    std::optional<std::string> read_value(const std::string& key, const KeyDirEntry& entry,
+                                          const DataFile* data_file) const;
+    // Takes the id of a new data file, nullopt once they no longer fit the
+    // 32 bits the KeyDir keeps.
+    std::optional<uint64_t> next_file_id();
+    // Seals the lane's active file and switches to a new one. On failure the
+    // lane keeps its active file.
+    bool create_new_data_file(WriteLane& lane);
+    std::string data_file_path(uint64_t file_id) const;
+    std::string hint_file_path(uint64_t file_id) const;
+    // Reads the hint entries of a data file, from its hint file or else from
+    // the file itself. Only at open (recovering) does it write the missing
+    // hint file and cut off the torn tail of a file that was not sealed. Any
+    // other damaged record fails the load, records holds the ones before it.
+    bool load_data_file(const std::shared_ptr<DataFile>& data_file, std::vector<HintRecord>& records,
+                        bool recovering);
     void load_all_data_files();
-    bool flush_data_records(std::vector<DataRecord>& batch);
-    void flush_worker();
+    // Counts the record at entry as dead in its data file.
+    void mark_dead(uint64_t key_size, const KeyDirEntry& entry);
+    bool flush_data_records(WriteLane& lane, FlushBatch& batch);
+    void flush_worker(WriteLane& lane);
+    void handoff_batch(WriteLane& lane, FlushBatch& batch);
+    void write_worker(WriteLane& lane);
     void compact_worker();
+    // Hands a stats snapshot to Params::stats_exporter at every interval.
+    void stats_worker();
     void compact();
-    void compact_data_file(std::shared_ptr<DataFile> orig_data_file);
+    // Waits while compaction is paused, false once the store is stopping.
+    bool compaction_resumed();
+    // Waits until compaction may do bytes of I/O, false once stopping.
+    bool throttle_compaction(uint64_t bytes);
+    bool foreground_busy() const;
+    // Rewrites the live records of inputs (sorted by id) into one new file,
+    // then removes the inputs.
+    void merge_data_files(const std::vector<std::shared_ptr<DataFile>>& inputs);
 
    private:
     std::string data_dir_;
     Params params_;
+    std::shared_ptr<IoBackend> io_backend_;
     folly::ConcurrentHashMap<uint64_t, std::shared_ptr<DataFile>> data_files_;
     std::atomic<uint64_t> last_file_id_ = 0;
-    std::shared_ptr<DataFile> active_data_file_;
+    // Sequence number of the next record written, orders writes across lanes.
+    std::atomic<uint64_t> next_seq_ = 1;
     KeyDir key_dir_;
-    std::mutex file_mutex_;
-    mutable std::shared_mutex io_mutex_;
-    folly::MPMCQueue<std::shared_ptr<KVQueueEntry>> flush_queue_;
+    // Sorted keys, only with Params::ordered_index.
+    std::unique_ptr<OrderedIndex> ordered_index_;
+    // Held while a WriteBatch spanning lanes queues itself and its barriers,
+    // so every lane meets the fences in the same order.
+    std::mutex fence_mutex_;
+    // Serializes the KeyDir updates of multi-record batches. apply_version_ is
+    // odd while one is applied, lookups that overlap it retry so they never
+    // see a batch half applied.
+    std::mutex apply_mutex_;
+    std::atomic<uint64_t> apply_version_ = 0;
+    std::vector<std::unique_ptr<WriteLane>> lanes_;
     std::atomic<bool> stop_{false};
-    std::thread flush_thread_;
     std::thread compact_thread_;
+    std::mutex compact_mutex_;
+    // Held by a merge while it checks its inputs for pins and while it
+    // publishes its output, and by fold while it pins its files, so a merge
+    // never replaces a pinned file.
+    mutable std::mutex merge_mutex_;
+    std::condition_variable compact_cv_;
+    bool compaction_paused_ = false;
+    RateLimiter compaction_limiter_;
+    mutable LatencyAverage get_latency_;
+    mutable StoreStats stats_;
+    std::thread stats_thread_;
+    std::unique_ptr<folly::CPUThreadPoolExecutor> read_executor_;
+    // Serves get_async, apart from read_executor_ so a flood of async gets
+    // does not hold up multi_get.
+    std::shared_ptr<folly::Executor> async_read_executor_;
+    // get_async reads queued or running, which hold on to the store. They
+    // finish under async_reads_mutex_ and wake the destructor when the last
+    // one is done.
+    mutable std::atomic<uint64_t> pending_async_reads_ = 0;
+    mutable std::mutex async_reads_mutex_;
+    mutable std::condition_variable async_reads_done_;
+    std::unique_ptr<ValueCache> value_cache_;
+    std::unique_ptr<ValueCodec> value_codec_;
 };
 
 }  // namespace bitcask
\ No newline at end of file
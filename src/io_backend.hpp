@@ -0,0 +1,366 @@
+/**
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <span>
+
+#ifdef BITCASK_WITH_IO_URING
+#include <liburing.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+#endif
+
+#include "bitcask.hpp"
+namespace bitcask {
+
+struct ReadOp {
+    int fd;
+    uint64_t offset;
+    uint8_t *buffer;
+    uint64_t size;
+    // Bytes read, or -1 on error.
+    int64_t result = 0;
+};
+
+// The syscalls DataFile uses to read and write, so they can be issued through
+// something other than blocking pread/write.
+class IoBackend {
+   public:
+    virtual ~IoBackend() = default;
+
+    // Reads up to size bytes at offset, short only at the end of the file.
+    // Returns the bytes read or -1.
+    virtual int64_t read(int fd, uint64_t offset, uint8_t *buffer, uint64_t size) = 0;
+    // Issues all the reads together and fills in each op's result.
+    virtual void read_batch(std::span<ReadOp> ops) = 0;
+    // Writes the whole buffer at offset.
+    virtual bool write(int fd, uint64_t offset, const uint8_t *buffer, uint64_t size) = 0;
+    virtual bool sync(int fd) = 0;
+
+    // Lets the backend register long lived fds with the kernel.
+    virtual void register_file(int /* fd */) {}
+    virtual void unregister_file(int /* fd */) {}
+    // Whether read_batch is cheaper than issuing the reads one by one.
+    virtual bool batches_reads() const { return false; }
+};
+
+class PosixIoBackend : public IoBackend {
+   public:
+    int64_t read(int fd, uint64_t offset, uint8_t *buffer, uint64_t size) override {
+        uint64_t total_read = 0;
+        while (total_read < size) {
+            ssize_t bytes_read = pread(fd, buffer + total_read, size - total_read, offset + total_read);
+            if (bytes_read == 0) {
+                break;
+            } else if (bytes_read == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
+                perror("read failed");
+                return -1;
+            }
+            total_read += bytes_read;
+        }
+        return total_read;
+    }
+
+    void read_batch(std::span<ReadOp> ops) override {
+        for (auto &op : ops) {
+            op.result = read(op.fd, op.offset, op.buffer, op.size);
+        }
+    }
+
+    bool write(int fd, uint64_t offset, const uint8_t *buffer, uint64_t size) override {
+        uint64_t total_written = 0;
+        while (total_written < size) {
+            ssize_t bytes_written = pwrite(fd, buffer + total_written, size - total_written, offset + total_written);
+            if (bytes_written == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
+                perror("write failed");
+                return false;
+            } else if (bytes_written == 0) {
+                break;
+            }
+            total_written += bytes_written;
+        }
+        return total_written == size;
+    }
+
+    bool sync(int fd) override {
+        if (fdatasync(fd) != 0) {
+            perror("fdatasync failed");
+            return false;
+        }
+        return true;
+    }
+};
+
+#ifdef BITCASK_WITH_IO_URING
+// io_uring backend shared by every DataFile of a store. Any thread can submit;
+// one waiting thread at a time reaps completions for everybody, so gets,
+// multi_get batches and compaction reads all share one deep queue. Data file
+// fds are registered with the ring to skip the per-op fd lookup.
+class UringIoBackend : public IoBackend {
+   public:
+    explicit UringIoBackend(uint32_t queue_depth) {
+        auto ret = io_uring_queue_init(queue_depth, &ring_, 0);
+        if (ret < 0) {
+            errno = -ret;
+            perror("io_uring_queue_init failed");
+            throw std::runtime_error("Failed to create io_uring");
+        }
+        fixed_files_ = io_uring_register_files_sparse(&ring_, kMaxFixedFiles) == 0;
+    }
+
+    ~UringIoBackend() override { io_uring_queue_exit(&ring_); }
+
+    int64_t read(int fd, uint64_t offset, uint8_t *buffer, uint64_t size) override {
+        ReadOp op{.fd = fd, .offset = offset, .buffer = buffer, .size = size};
+        read_batch(std::span<ReadOp>(&op, 1));
+        return op.result;
+    }
+
+    void read_batch(std::span<ReadOp> ops) override {
+        std::vector<Request> requests(ops.size());
+        for (size_t i = 0; i < ops.size(); i++) {
+            ops[i].result = 0;
+        }
+
+        // Resubmit the remainder of short reads until each op hits EOF, fails
+        // or is complete.
+        std::vector<size_t> pending(ops.size());
+        for (size_t i = 0; i < ops.size(); i++) pending[i] = i;
+        while (!pending.empty()) {
+            {
+                std::lock_guard lock(sq_mutex_);
+                for (auto i : pending) {
+                    auto &op = ops[i];
+                    requests[i] = Request{};
+                    auto sqe = get_sqe();
+                    io_uring_prep_read(sqe, fixed_fd(op.fd), op.buffer + op.result, op_size(op.size - op.result),
+                                       op.offset + op.result);
+                    set_fixed_flag(sqe, op.fd);
+                    io_uring_sqe_set_data(sqe, &requests[i]);
+                }
+                io_uring_submit(&ring_);
+            }
+
+            std::vector<size_t> next;
+            for (auto i : pending) {
+                auto res = wait(requests[i]);
+                auto &op = ops[i];
+                if (res == -EAGAIN || res == -EINTR) {
+                    next.push_back(i);
+                } else if (res < 0) {
+                    errno = -res;
+                    perror("read failed");
+                    op.result = -1;
+                } else if (res > 0) {
+                    op.result += res;
+                    if (static_cast<uint64_t>(op.result) < op.size) next.push_back(i);
+                }
+            }
+            pending = std::move(next);
+        }
+    }
+
+    bool write(int fd, uint64_t offset, const uint8_t *buffer, uint64_t size) override {
+        uint64_t total_written = 0;
+        while (total_written < size) {
+            Request request;
+            {
+                std::lock_guard lock(sq_mutex_);
+                auto sqe = get_sqe();
+                io_uring_prep_write(sqe, fixed_fd(fd), buffer + total_written, op_size(size - total_written),
+                                    offset + total_written);
+                set_fixed_flag(sqe, fd);
+                io_uring_sqe_set_data(sqe, &request);
+                io_uring_submit(&ring_);
+            }
+            auto res = wait(request);
+            if (res == -EAGAIN || res == -EINTR) continue;
+            if (res <= 0) {
+                errno = -res;
+                perror("write failed");
+                return false;
+            }
+            total_written += res;
+        }
+        return true;
+    }
+
+    bool sync(int fd) override {
+        Request request;
+        {
+            std::lock_guard lock(sq_mutex_);
+            auto sqe = get_sqe();
+            io_uring_prep_fsync(sqe, fixed_fd(fd), IORING_FSYNC_DATASYNC);
+            set_fixed_flag(sqe, fd);
+            io_uring_sqe_set_data(sqe, &request);
+            io_uring_submit(&ring_);
+        }
+        auto res = wait(request);
+        if (res < 0) {
+            errno = -res;
+            perror("fdatasync failed");
+            return false;
+        }
+        return true;
+    }
+
+    void register_file(int fd) override {
+        std::lock_guard lock(sq_mutex_);
+        if (!fixed_files_ || (next_fixed_index_ == kMaxFixedFiles && free_fixed_indexes_.empty())) {
+            return;
+        }
+        uint32_t index;
+        if (!free_fixed_indexes_.empty()) {
+            index = free_fixed_indexes_.back();
+            free_fixed_indexes_.pop_back();
+        } else {
+            index = next_fixed_index_++;
+        }
+        if (io_uring_register_files_update(&ring_, index, &fd, 1) != 1) {
+            free_fixed_indexes_.push_back(index);
+            return;
+        }
+        fixed_indexes_[fd] = index;
+    }
+
+    void unregister_file(int fd) override {
+        std::lock_guard lock(sq_mutex_);
+        auto iter = fixed_indexes_.find(fd);
+        if (iter == fixed_indexes_.end()) {
+            return;
+        }
+        int empty = -1;
+        io_uring_register_files_update(&ring_, iter->second, &empty, 1);
+        free_fixed_indexes_.push_back(iter->second);
+        fixed_indexes_.erase(iter);
+    }
+
+    bool batches_reads() const override { return true; }
+
+   private:
+    struct Request {
+        int32_t result = 0;
+        bool done = false;
+    };
+
+    static constexpr uint32_t kMaxFixedFiles = 4096;
+    // Ops take a 32-bit length and the kernel caps reads and writes below
+    // 2GiB, larger ones are issued in pieces.
+    static constexpr uint64_t kMaxOpSize = 1 << 30;
+
+    static uint32_t op_size(uint64_t size) { return std::min(size, kMaxOpSize); }
+
+    // Called with sq_mutex_ held. Flushes the submission queue when it is full.
+    io_uring_sqe *get_sqe() {
+        while (true) {
+            if (auto sqe = io_uring_get_sqe(&ring_)) {
+                return sqe;
+            }
+            io_uring_submit(&ring_);
+        }
+    }
+
+    // Called with sq_mutex_ held.
+    int fixed_fd(int fd) {
+        auto iter = fixed_indexes_.find(fd);
+        return iter == fixed_indexes_.end() ? fd : iter->second;
+    }
+    void set_fixed_flag(io_uring_sqe *sqe, int fd) {
+        if (fixed_indexes_.count(fd)) {
+            io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+        }
+    }
+
+    // Waits for request to complete. Whichever waiter finds no reaper running
+    // becomes the reaper and completes requests for all the other threads.
+    int32_t wait(Request &request) {
+        std::unique_lock lock(cq_mutex_);
+        while (!request.done) {
+            if (reaping_) {
+                cq_cv_.wait(lock);
+                continue;
+            }
+            reaping_ = true;
+            lock.unlock();
+
+            io_uring_cqe *cqe;
+            auto ret = io_uring_wait_cqe(&ring_, &cqe);
+            lock.lock();
+            if (ret == 0) {
+                io_uring_cqe *cqes[64];
+                unsigned count;
+                while ((count = io_uring_peek_batch_cqe(&ring_, cqes, 64)) > 0) {
+                    for (unsigned i = 0; i < count; i++) {
+                        auto completed = static_cast<Request *>(io_uring_cqe_get_data(cqes[i]));
+                        completed->result = cqes[i]->res;
+                        completed->done = true;
+                    }
+                    io_uring_cq_advance(&ring_, count);
+                }
+            }
+            reaping_ = false;
+            cq_cv_.notify_all();
+        }
+        return request.result;
+    }
+
+    io_uring ring_;
+    std::mutex sq_mutex_;
+    std::mutex cq_mutex_;
+    std::condition_variable cq_cv_;
+    bool reaping_ = false;
+    bool fixed_files_ = false;
+    std::unordered_map<int, uint32_t> fixed_indexes_;
+    std::vector<uint32_t> free_fixed_indexes_;
+    uint32_t next_fixed_index_ = 0;
+};
+#endif
+
+inline std::shared_ptr<IoBackend> make_io_backend(const Params &params) {
+#ifdef BITCASK_WITH_IO_URING
+    if (params.io_backend == IoBackendType::kIoUring) {
+        return std::make_shared<UringIoBackend>(params.io_uring_queue_depth);
+    }
+#else
+    if (params.io_backend == IoBackendType::kIoUring) {
+        std::cout << "bitcask built without io_uring, using the posix backend" << std::endl;
+    }
+#endif
+    return std::make_shared<PosixIoBackend>();
+}
+
+}  // namespace bitcask
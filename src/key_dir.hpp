@@ -21,10 +21,23 @@ THE SOFTWARE.
 */
 
 #pragma once
+#include <folly/synchronization/Rcu.h>
 
-#include <folly/concurrency/ConcurrentHashMap.h>
-
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "bitcask.hpp"
 namespace bitcask {
 
 struct KeyDirEntry {
@@ -32,29 +45,359 @@ struct KeyDirEntry {
     uint64_t value_size;
     uint64_t value_offset;
     uint64_t tstamp;
+    // RecordCodec of the stored value.
+    uint8_t codec = 0;
+};
+
+// Append only storage for the keys of a KeyDir shard. Each key is stored as a
+// 32-bit length followed by the key bytes, so a key costs 4 bytes on top of
+// its length and no per-key heap allocation.
+class KeyArena {
+   public:
+    const char* add(std::string_view key) {
+        auto size = sizeof(uint32_t) + key.size();
+        if (chunk_used_ + size > chunk_size_) {
+            chunk_size_ = std::max(kChunkSize, size);
+            chunks_.emplace_back(std::make_unique<char[]>(chunk_size_));
+            chunk_used_ = 0;
+            capacity_ += chunk_size_;
+        }
+        auto ptr = chunks_.back().get() + chunk_used_;
+        uint32_t key_size = key.size();
+        std::memcpy(ptr, &key_size, sizeof(uint32_t));
+        std::memcpy(ptr + sizeof(uint32_t), key.data(), key.size());
+        chunk_used_ += size;
+        total_bytes_ += size;
+        return ptr;
+    }
+
+    void release(const char* ptr) { dead_bytes_ += sizeof(uint32_t) + key(ptr).size(); }
+
+    static std::string_view key(const char* ptr) {
+        uint32_t key_size;
+        std::memcpy(&key_size, ptr, sizeof(uint32_t));
+        return std::string_view(ptr + sizeof(uint32_t), key_size);
+    }
+
+    uint64_t live_bytes() const { return total_bytes_ - dead_bytes_; }
+    uint64_t dead_bytes() const { return dead_bytes_; }
+    uint64_t capacity() const { return capacity_; }
+
+   private:
+    static constexpr uint64_t kChunkSize = 64 * 1024;
+    std::vector<std::unique_ptr<char[]>> chunks_;
+    uint64_t chunk_size_ = 0;
+    uint64_t chunk_used_ = 0;
+    uint64_t capacity_ = 0;
+    uint64_t total_bytes_ = 0;
+    uint64_t dead_bytes_ = 0;
 };
 
+// Memory optimised map from key to KeyDirEntry. Keys live in per-shard arenas
+// and entries are packed into 32-byte slots of an open addressing table with
+// linear probing.
+//
+// Lookups take no lock. Writers serialize on the shard mutex and bump the
+// shard version to odd while they change slots, a lookup that overlapped a
+// change retries. Tables and arenas replaced by a rehash are retired through
+// RCU, so a lookup still probing them never touches freed memory.
 class KeyDir {
    public:
     KeyDir() = default;
-    ~KeyDir() = default;
+    ~KeyDir() {
+        for (auto& shard : shards_) {
+            delete shard.table.load();
+        }
+    }
 
-    void insert(const std::string& key, const KeyDirEntry& entry) {
-        key_dir_.insert_or_assign(key, entry);
+    // Returns the entry the key had before, if any.
+    std::optional<KeyDirEntry> insert(std::string_view key, const KeyDirEntry& entry) {
+        auto hash = hash_key(key);
+        auto& shard = shard_for(hash);
+        std::lock_guard lock(shard.mutex);
+        auto table = shard.table.load(std::memory_order_relaxed);
+        if (!table || (shard.used + 1) * kMaxLoadDen > table->slots.size() * kMaxLoadNum) {
+            table = rehash(shard);
+        }
+
+        WriteSection section(shard);
+        auto capacity = table->slots.size();
+        Slot* free_slot = nullptr;
+        for (auto index = home(hash, capacity);; index = next(index, capacity)) {
+            auto& slot = table->slots[index];
+            auto key_ref = slot.key_ref.load(std::memory_order_relaxed);
+            if (key_ref == kEmpty) {
+                if (!free_slot) {
+                    free_slot = &slot;
+                    shard.used++;
+                }
+                break;
+            }
+            if (key_ref == kDeleted) {
+                if (!free_slot) free_slot = &slot;
+                continue;
+            }
+            if (matches(slot, hash, key)) {
+                auto previous = unpack(slot);
+                pack(slot, entry);
+                return previous;
+            }
+        }
+
+        pack(*free_slot, entry);
+        free_slot->key_ref.store(make_key_ref(shard.arena->add(key), hash), std::memory_order_release);
+        shard.size++;
+        return {};
+    }
+
+    // Returns the removed entry, if any.
+    std::optional<KeyDirEntry> remove(std::string_view key) {
+        auto hash = hash_key(key);
+        auto& shard = shard_for(hash);
+        std::lock_guard lock(shard.mutex);
+        auto table = shard.table.load(std::memory_order_relaxed);
+        if (auto slot = table ? find(*table, hash, key) : nullptr) {
+            WriteSection section(shard);
+            auto previous = unpack(*slot);
+            shard.arena->release(key_ptr(slot->key_ref.load(std::memory_order_relaxed)));
+            slot->key_ref.store(kDeleted, std::memory_order_relaxed);
+            shard.size--;
+            return previous;
+        }
+        return {};
     }
-    void remove(const std::string& key) {
-        key_dir_.erase(key);
+
+    // Replaces the entry of key only if it still points at the location of
+    // expected, so a record moved by compaction never overrides a newer write.
+    bool update_if(std::string_view key, const KeyDirEntry& expected, const KeyDirEntry& entry) {
+        auto hash = hash_key(key);
+        auto& shard = shard_for(hash);
+        std::lock_guard lock(shard.mutex);
+        auto table = shard.table.load(std::memory_order_relaxed);
+        auto slot = table ? find(*table, hash, key) : nullptr;
+        if (!slot) {
+            return false;
+        }
+        auto current = unpack(*slot);
+        if (current.file_id != expected.file_id || current.value_offset != expected.value_offset) {
+            return false;
+        }
+        WriteSection section(shard);
+        pack(*slot, entry);
+        return true;
+    }
+
+    std::optional<KeyDirEntry> get(std::string_view key) const {
+        auto hash = hash_key(key);
+        auto& shard = shard_for(hash);
+        folly::rcu_reader guard;
+        while (true) {
+            auto version = shard.version.load(std::memory_order_acquire);
+            if (version & 1) {
+                std::this_thread::yield();
+                continue;
+            }
+            std::optional<KeyDirEntry> ret;
+            if (auto table = shard.table.load(std::memory_order_acquire)) {
+                if (auto slot = find(*table, hash, key)) {
+                    ret = unpack(*slot);
+                }
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (shard.version.load(std::memory_order_relaxed) == version) {
+                return ret;
+            }
+        }
+    }
+
+    uint64_t size() const {
+        uint64_t size = 0;
+        for (auto& shard : shards_) {
+            std::lock_guard lock(shard.mutex);
+            size += shard.size;
+        }
+        return size;
     }
 
-    std::optional<KeyDirEntry> get(const std::string& key) const {
-        auto iter = key_dir_.find(key);
-        if (iter == key_dir_.end()) {
-            return {};
+    // Bytes held by the tables and key arenas.
+    uint64_t memory_usage() const {
+        uint64_t bytes = sizeof(*this);
+        for (auto& shard : shards_) {
+            std::lock_guard lock(shard.mutex);
+            if (auto table = shard.table.load(std::memory_order_relaxed)) {
+                bytes += table->slots.capacity() * sizeof(Slot);
+            }
+            bytes += shard.arena->capacity();
         }
-        return iter->second;
+        return bytes;
     }
 
    private:
-    folly::ConcurrentHashMap<std::string, KeyDirEntry> key_dir_;
+    // An empty slot has key_ref 0 and a removed one kDeleted. Otherwise the
+    // low 48 bits point to the key in the arena and the top 16 bits hold more
+    // hash bits, so most mismatching probes never touch the arena. The codec
+    // takes the top byte of tstamp. Fields are atomics since lookups read
+    // them while a writer may change them.
+    struct Slot {
+        std::atomic<uint64_t> key_ref;
+        std::atomic<uint32_t> file_id;
+        std::atomic<uint32_t> value_size;
+        std::atomic<uint64_t> value_offset;
+        std::atomic<uint64_t> tstamp;
+    };
+    static_assert(sizeof(Slot) == 32);
+
+    struct Table {
+        explicit Table(uint64_t capacity) : slots(capacity) {}
+        std::vector<Slot> slots;
+    };
+
+    struct Shard {
+        mutable std::mutex mutex;
+        // Odd while a writer changes slots in place.
+        std::atomic<uint64_t> version = 0;
+        std::atomic<Table*> table = nullptr;
+        // Live plus deleted slots.
+        uint64_t used = 0;
+        uint64_t size = 0;
+        std::unique_ptr<KeyArena> arena = std::make_unique<KeyArena>();
+    };
+
+    // Marks the shard version odd for the lifetime of the section.
+    class WriteSection {
+       public:
+        explicit WriteSection(Shard& shard) : shard_(shard) {
+            shard_.version.store(shard_.version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+        ~WriteSection() {
+            shard_.version.store(shard_.version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+       private:
+        Shard& shard_;
+    };
+
+    static constexpr uint64_t kNumShards = 64;
+    static constexpr uint64_t kMinSlots = 16;
+    // Grow once 7/8 of the slots are used.
+    static constexpr uint64_t kMaxLoadNum = 7;
+    static constexpr uint64_t kMaxLoadDen = 8;
+    static constexpr uint64_t kEmpty = 0;
+    static constexpr uint64_t kDeleted = 1;
+    static constexpr uint64_t kPtrMask = (1ULL << 48) - 1;
+    static constexpr uint64_t kTstampMask = (1ULL << 56) - 1;
+
+    static uint64_t hash_key(std::string_view key) { return std::hash<std::string_view>{}(key); }
+    Shard& shard_for(uint64_t hash) { return shards_[hash >> 58]; }
+    const Shard& shard_for(uint64_t hash) const { return shards_[hash >> 58]; }
+
+    // Maps the hash onto [0, capacity) with a multiply instead of a modulo,
+    // after mixing so the slot is independent of the shard and tag bits.
+    static uint64_t home(uint64_t hash, uint64_t capacity) {
+        return (static_cast<__uint128_t>(hash * 0x9e3779b97f4a7c15ULL) * capacity) >> 64;
+    }
+    static uint64_t next(uint64_t index, uint64_t capacity) { return index + 1 == capacity ? 0 : index + 1; }
+
+    static uint64_t make_key_ref(const char* ptr, uint64_t hash) {
+        auto ref = reinterpret_cast<uint64_t>(ptr);
+        assert((ref & ~kPtrMask) == 0);
+        return ref | (tag(hash) << 48);
+    }
+    static uint64_t tag(uint64_t hash) { return (hash >> 42) & 0xffff; }
+    static const char* key_ptr(uint64_t key_ref) { return reinterpret_cast<const char*>(key_ref & kPtrMask); }
+
+    // Key bytes are written before the key_ref that points at them is
+    // published and never change after, so the acquire load makes them safe
+    // to read for a lookup.
+    static bool matches(const Slot& slot, uint64_t hash, std::string_view key) {
+        auto key_ref = slot.key_ref.load(std::memory_order_acquire);
+        if (key_ref == kEmpty || key_ref == kDeleted) {
+            return false;
+        }
+        return (key_ref >> 48) == tag(hash) && KeyArena::key(key_ptr(key_ref)) == key;
+    }
+
+    // BitCask rejects larger values and file ids before they get here.
+    static_assert(kMaxValueSize <= UINT32_MAX);
+    static void pack(Slot& slot, const KeyDirEntry& entry) {
+        assert(entry.file_id <= UINT32_MAX && entry.value_size <= UINT32_MAX && entry.tstamp <= kTstampMask);
+        slot.file_id.store(entry.file_id, std::memory_order_relaxed);
+        slot.value_size.store(entry.value_size, std::memory_order_relaxed);
+        slot.value_offset.store(entry.value_offset, std::memory_order_relaxed);
+        slot.tstamp.store(entry.tstamp | static_cast<uint64_t>(entry.codec) << 56, std::memory_order_relaxed);
+    }
+
+    static KeyDirEntry unpack(const Slot& slot) {
+        auto tstamp = slot.tstamp.load(std::memory_order_relaxed);
+        return KeyDirEntry{.file_id = slot.file_id.load(std::memory_order_relaxed),
+                           .value_size = slot.value_size.load(std::memory_order_relaxed),
+                           .value_offset = slot.value_offset.load(std::memory_order_relaxed),
+                           .tstamp = tstamp & kTstampMask,
+                           .codec = static_cast<uint8_t>(tstamp >> 56)};
+    }
+
+    // Probing always ends, slots only go from empty to used within a table
+    // and a table is never full.
+    template <typename TableT>
+    static auto find(TableT& table, uint64_t hash, std::string_view key) -> decltype(&table.slots[0]) {
+        auto capacity = table.slots.size();
+        for (auto index = home(hash, capacity);; index = next(index, capacity)) {
+            auto& slot = table.slots[index];
+            if (slot.key_ref.load(std::memory_order_relaxed) == kEmpty) {
+                return nullptr;
+            }
+            if (matches(slot, hash, key)) {
+                return &slot;
+            }
+        }
+    }
+
+    // Rebuilds the table, growing it by half unless most used slots are
+    // deleted ones. Growing by 1.5x rather than 2x keeps the average load
+    // factor around 0.7. Keys are copied to a fresh arena once half of it is
+    // garbage. Lookups keep using the old table until the new one is
+    // published, which is fine since the shard mutex holds off all changes.
+    Table* rehash(Shard& shard) {
+        auto old_table = shard.table.load(std::memory_order_relaxed);
+        uint64_t old_capacity = old_table ? old_table->slots.size() : 0;
+        auto capacity = std::max(kMinSlots, old_capacity);
+        if (shard.size * 2 >= shard.used) {
+            capacity = std::max(kMinSlots, old_capacity + old_capacity / 2);
+        }
+        bool compact_arena = shard.arena->dead_bytes() > shard.arena->live_bytes();
+
+        auto table = new Table(capacity);
+        auto arena = compact_arena ? std::make_unique<KeyArena>() : nullptr;
+        for (uint64_t i = 0; i < old_capacity; i++) {
+            auto& slot = old_table->slots[i];
+            auto key_ref = slot.key_ref.load(std::memory_order_relaxed);
+            if (key_ref == kEmpty || key_ref == kDeleted) {
+                continue;
+            }
+            auto key = KeyArena::key(key_ptr(key_ref));
+            auto hash = hash_key(key);
+            auto index = home(hash, capacity);
+            while (table->slots[index].key_ref.load(std::memory_order_relaxed) != kEmpty) {
+                index = next(index, capacity);
+            }
+            auto& new_slot = table->slots[index];
+            pack(new_slot, unpack(slot));
+            new_slot.key_ref.store(compact_arena ? make_key_ref(arena->add(key), hash) : key_ref,
+                                   std::memory_order_relaxed);
+        }
+
+        shard.table.store(table, std::memory_order_release);
+        shard.used = shard.size;
+        if (old_table) {
+            folly::rcu_retire(old_table);
+        }
+        if (compact_arena) {
+            folly::rcu_retire(std::exchange(shard.arena, std::move(arena)).release());
+        }
+        return table;
+    }
+
+    std::array<Shard, kNumShards> shards_;
 };
-}  // namespace bitcask
\ No newline at end of file
+}  // namespace bitcask
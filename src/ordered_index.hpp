@@ -0,0 +1,79 @@
+/**
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#pragma once
+#include <folly/ConcurrentSkipList.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace bitcask {
+
+// The keys of the KeyDir in sorted order, for range and prefix scans.
+//
+// Writers add a key when the KeyDir gains it and remove it when a tombstone
+// drops it, right after the KeyDir update. Compaction only moves values, so
+// it leaves the index alone. A range may briefly hold a key the KeyDir just
+// dropped, callers look every key up in the KeyDir anyway.
+class OrderedIndex {
+   public:
+    OrderedIndex() : keys_(SkipList::createInstance(kHeadHeight)) {}
+
+    void insert(std::string_view key) { SkipList::Accessor(keys_).add(std::string(key)); }
+    void remove(std::string_view key) { SkipList::Accessor(keys_).remove(std::string(key)); }
+
+    // Keys in [begin, end) in order, at most limit of them unless it is 0. An
+    // empty end has no upper bound.
+    std::vector<std::string> range(const std::string &begin, const std::string &end, uint64_t limit) const {
+        SkipList::Accessor accessor(keys_);
+        std::vector<std::string> keys;
+        for (auto iter = accessor.lower_bound(begin); iter != accessor.end(); ++iter) {
+            if ((!end.empty() && *iter >= end) || (limit && keys.size() >= limit)) {
+                break;
+            }
+            keys.emplace_back(*iter);
+        }
+        return keys;
+    }
+
+    // The first key after all the keys starting with prefix, empty if there
+    // is none.
+    static std::string prefix_end(std::string prefix) {
+        while (!prefix.empty() && static_cast<uint8_t>(prefix.back()) == 0xff) {
+            prefix.pop_back();
+        }
+        if (!prefix.empty()) {
+            prefix.back()++;
+        }
+        return prefix;
+    }
+
+   private:
+    using SkipList = folly::ConcurrentSkipList<std::string>;
+    static constexpr int kHeadHeight = 16;
+    std::shared_ptr<SkipList> keys_;
+};
+
+}  // namespace bitcask
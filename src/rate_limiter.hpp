@@ -0,0 +1,102 @@
+/**
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+namespace bitcask {
+
+// Token bucket limiting background I/O to a number of bytes per second, 0
+// means unlimited. Up to kBurst worth of unused tokens are kept. A request
+// larger than what is available is let through and puts the bucket in debt,
+// so big requests are never starved and the average rate still holds.
+class RateLimiter {
+   public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit RateLimiter(uint64_t bytes_per_sec) : rate_(bytes_per_sec), last_refill_(Clock::now()) {
+        tokens_ = max_tokens();
+    }
+
+    void set_rate(uint64_t bytes_per_sec) {
+        std::lock_guard lock(mutex_);
+        refill(Clock::now());
+        rate_ = bytes_per_sec;
+        tokens_ = std::min(tokens_, max_tokens());
+        cv_.notify_all();
+    }
+
+    uint64_t rate() const {
+        std::lock_guard lock(mutex_);
+        return rate_;
+    }
+
+    // Blocks until bytes may be used. Returns false if cancelled meanwhile.
+    bool request(uint64_t bytes) {
+        std::unique_lock lock(mutex_);
+        while (!cancelled_) {
+            if (rate_ == 0) {
+                return true;
+            }
+            auto now = Clock::now();
+            refill(now);
+            if (tokens_ > 0) {
+                tokens_ -= bytes;
+                return true;
+            }
+            // Sleep until the debt is paid off, or the rate changes.
+            auto wait = std::chrono::duration<double>((1 - tokens_) / rate_);
+            cv_.wait_until(lock, now + std::chrono::duration_cast<Clock::duration>(wait));
+        }
+        return false;
+    }
+
+    // Wakes up and fails all current and future requests.
+    void cancel() {
+        std::lock_guard lock(mutex_);
+        cancelled_ = true;
+        cv_.notify_all();
+    }
+
+   private:
+    static constexpr double kBurst = 0.1;
+
+    double max_tokens() const { return rate_ * kBurst; }
+
+    void refill(Clock::time_point now) {
+        auto elapsed = std::chrono::duration<double>(now - last_refill_).count();
+        tokens_ = std::min(max_tokens(), tokens_ + elapsed * rate_);
+        last_refill_ = now;
+    }
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    uint64_t rate_;
+    double tokens_ = 0;
+    Clock::time_point last_refill_;
+    bool cancelled_ = false;
+};
+}  // namespace bitcask
@@ -0,0 +1,169 @@
+/**
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "bitcask.hpp"
+namespace bitcask {
+
+// Counters and histograms are split into shards, each thread updates the one
+// its slot picks with relaxed atomics so hot paths rarely share a cache line.
+// A snapshot sums the shards and may miss updates racing with it.
+constexpr size_t kStatsShards = 8;
+
+inline size_t stats_shard() {
+    static std::atomic<size_t> next_shard = 0;
+    thread_local size_t shard = next_shard.fetch_add(1, std::memory_order_relaxed) % kStatsShards;
+    return shard;
+}
+
+class Counter {
+   public:
+    void add(uint64_t n = 1) { shards_[stats_shard()].value.fetch_add(n, std::memory_order_relaxed); }
+
+    uint64_t value() const {
+        uint64_t sum = 0;
+        for (auto& shard : shards_) {
+            sum += shard.value.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+   private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> value = 0;
+    };
+    std::array<Shard, kStatsShards> shards_;
+};
+
+// Log-linear histogram: every power of two is split into 2^kSubBits buckets,
+// so a percentile is off by at most 1/2^kSubBits of its value. Values below
+// 2^kSubBits are exact.
+template <int kSubBits>
+class LogLinearHistogram {
+   public:
+    LogLinearHistogram() : shards_(std::make_unique<Shard[]>(kStatsShards)) {}
+
+    void record(uint64_t value) {
+        auto& shard = shards_[stats_shard()];
+        shard.counts[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+        shard.sum.fetch_add(value, std::memory_order_relaxed);
+        auto max = shard.max.load(std::memory_order_relaxed);
+        while (value > max && !shard.max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    HistogramStats snapshot() const {
+        HistogramStats stats;
+        std::array<uint64_t, kBuckets> counts{};
+        for (size_t i = 0; i < kStatsShards; i++) {
+            auto& shard = shards_[i];
+            for (size_t j = 0; j < kBuckets; j++) {
+                counts[j] += shard.counts[j].load(std::memory_order_relaxed);
+            }
+            stats.sum += shard.sum.load(std::memory_order_relaxed);
+            stats.max = std::max(stats.max, shard.max.load(std::memory_order_relaxed));
+        }
+        for (auto count : counts) {
+            stats.count += count;
+        }
+        stats.p50 = percentile(counts, stats.count, 0.5, stats.max);
+        stats.p99 = percentile(counts, stats.count, 0.99, stats.max);
+        stats.p999 = percentile(counts, stats.count, 0.999, stats.max);
+        return stats;
+    }
+
+   private:
+    static constexpr size_t kBuckets = (64 - kSubBits + 1) << kSubBits;
+
+    static size_t bucket(uint64_t value) {
+        if (value < (1u << kSubBits)) {
+            return value;
+        }
+        int shift = std::bit_width(value) - 1 - kSubBits;
+        return ((shift + 1) << kSubBits) + ((value >> shift) & ((1u << kSubBits) - 1));
+    }
+
+    // Largest value that falls into bucket i.
+    static uint64_t bucket_limit(size_t i) {
+        if (i < (1u << kSubBits)) {
+            return i;
+        }
+        int shift = (i >> kSubBits) - 1;
+        uint64_t base = (1ull << kSubBits) | (i & ((1u << kSubBits) - 1));
+        return ((base + 1) << shift) - 1;
+    }
+
+    static uint64_t percentile(const std::array<uint64_t, kBuckets>& counts, uint64_t total, double quantile,
+                               uint64_t max) {
+        if (total == 0) {
+            return 0;
+        }
+        auto rank = std::max<uint64_t>(1, quantile * total);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBuckets; i++) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return std::min(bucket_limit(i), max);
+            }
+        }
+        return max;
+    }
+
+    struct alignas(64) Shard {
+        std::array<std::atomic<uint64_t>, kBuckets> counts{};
+        std::atomic<uint64_t> sum = 0;
+        std::atomic<uint64_t> max = 0;
+    };
+    std::unique_ptr<Shard[]> shards_;
+};
+
+// The store's histograms, coarse enough to stay small.
+using Histogram = LogLinearHistogram<3>;
+
+// What BitCask::stats reports that is counted as it happens. Latencies are
+// in nanoseconds.
+struct StoreStats {
+    Histogram put_latency;
+    Histogram write_queue_depth;
+    Histogram flush_batch_bytes;
+    Histogram flush_batch_records;
+    Histogram write_records_latency;
+    Histogram get_cache_latency;
+    Histogram get_mmap_latency;
+    Histogram get_pread_latency;
+    Counter get_misses;
+    Counter compaction_bytes_read;
+    Counter compaction_bytes_written;
+    Counter compaction_bytes_reclaimed;
+    Counter merges;
+    Counter compaction_passes;
+};
+
+}  // namespace bitcask
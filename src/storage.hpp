@@ -23,198 +23,831 @@ THE SOFTWARE.
 #pragma once
 
 #include <fcntl.h>
+#include <folly/hash/Checksum.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
 #include <format>
 #include <fstream>
+#include <functional>
 #include <future>
 #include <iostream>
+#include <memory>
+#include <span>
 #include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <vector>
 
+#include "io_backend.hpp"
 namespace bitcask {
 
+// Set in DataRecordHeader::flags when crc holds the record's CRC32C.
+constexpr uint8_t kRecordHasCrc = 1;
+// Set in the flags of a v2 record for a tombstone.
+constexpr uint8_t kRecordTombstone = 2;
+// Set in DataFileHeader::flags once the writer sealed the file.
+constexpr uint32_t kDataFileSealed = 1;
+
+// Syncs the directory holding path, so a file created or renamed there
+// survives a crash.
+inline bool sync_parent_dir(const std::string &path) {
+    auto dir = std::filesystem::path(path).parent_path();
+    int fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        perror("directory open failed");
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    if (!ok) {
+        perror("directory fsync failed");
+    }
+    close(fd);
+    return ok;
+}
+
+// Layout of the records of a data file.
+enum class RecordFormat : uint8_t {
+    // A fixed DataRecordHeader per record, in files without a DataFileHeader.
+    kV1 = 1,
+    // After a DataFileHeader, each record is its crc (4 bytes), flags and
+    // codec (1 byte each), then the sequence number, key size and value size
+    // as varints, then the key and value.
+    kV2 = 2,
+};
+
+// Starts every data file written in the v2 format.
+struct DataFileHeader {
+    char magic[8] = {'B', 'C', 'D', 'A', 'T', 'A', '\0', '\0'};
+    uint32_t version = static_cast<uint32_t>(RecordFormat::kV2);
+    uint32_t flags = 0;
+};
+
+// Decoded header of a record in either format, and the on-disk header of v1
+// records.
 struct DataRecordHeader {
+    // CRC32C of the rest of the header, the key and the value. Older files
+    // wrote 0 and no kRecordHasCrc flag.
     uint32_t crc{0};
+    // Sequence number of the write, 0 in files from before they existed.
     uint64_t timestamp{0};
     uint32_t key_size{0};
+    // Stored size of the value.
     uint32_t value_size{0};
     bool tombstone{false};
+    // RecordCodec of the value. Takes a padding byte, which older files
+    // always wrote as zero.
+    uint8_t codec{0};
+    uint8_t flags{0};
     // Key and value bytes are stored after this.
 };
 
+// LEB128 varints of the v2 record headers.
+inline uint64_t varint_size(uint64_t value) {
+    uint64_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+inline uint8_t *put_varint(uint8_t *out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = static_cast<uint8_t>(value) | 0x80;
+        value >>= 7;
+    }
+    *out++ = static_cast<uint8_t>(value);
+    return out;
+}
+
+// Decodes the varint at in, nullptr if it runs past end.
+inline const uint8_t *get_varint(const uint8_t *in, const uint8_t *end, uint64_t &value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && in < end; shift += 7) {
+        auto byte = *in++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return in;
+        }
+    }
+    return nullptr;
+}
+
 struct DataRecord {
     std::string key;
+    // The value as stored, compressed with codec.
     std::string value;
     bool tombstone;
     uint64_t value_offset;
+    uint64_t seq = 0;
+    uint8_t codec = 0;
+};
+
+struct HintRecordHeader {
+    uint64_t timestamp{0};
+    uint64_t value_offset{0};
+    uint32_t key_size{0};
+    uint32_t value_size{0};
+    bool tombstone{false};
+    uint8_t codec{0};
+    // Key bytes are stored after this.
+};
+// The on-disk layout, padding included. HintFile::append zeroes the padding.
+static_assert(sizeof(HintRecordHeader) == 32);
+
+// KeyDir entry of a record as stored in a hint file, the file id is the hint
+// file's name.
+struct HintRecord {
+    std::string key;
+    uint64_t timestamp;
+    uint64_t value_size;
+    uint64_t value_offset;
+    bool tombstone;
+    uint8_t codec = 0;
+};
+
+// A hint file holds the key and value location of every record in a sealed
+// data file, so the KeyDir can be rebuilt without reading any values. It is
+// written to a temporary name and only renamed to its final name once complete.
+//
+// Hint files start with kMagic. Older ones without it left the codec byte of
+// their headers uninitialized, they are rejected and rebuilt from the data file.
+class HintFile {
+   public:
+    explicit HintFile(const std::string &file) : file_(file) {
+        fd_ = open(file_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd_ == -1) {
+            perror("");
+            throw std::runtime_error("Failed to open hint file for write");
+        }
+        buffer_.assign(kMagic, kMagic + sizeof(kMagic));
+    }
+
+    ~HintFile() {
+        if (fd_ != -1) close(fd_);
+    }
+
+    void append(const std::string &key, const HintRecordHeader &header) {
+        auto offset = buffer_.size();
+        buffer_.resize(offset + sizeof(HintRecordHeader) + key.size());
+        // Field by field so the padding stays zeroed and hint files are
+        // reproducible byte for byte.
+        auto out = buffer_.data() + offset;
+        std::memset(out, 0, sizeof(HintRecordHeader));
+        std::memcpy(out + offsetof(HintRecordHeader, timestamp), &header.timestamp, sizeof(header.timestamp));
+        std::memcpy(out + offsetof(HintRecordHeader, value_offset), &header.value_offset, sizeof(header.value_offset));
+        std::memcpy(out + offsetof(HintRecordHeader, key_size), &header.key_size, sizeof(header.key_size));
+        std::memcpy(out + offsetof(HintRecordHeader, value_size), &header.value_size, sizeof(header.value_size));
+        std::memcpy(out + offsetof(HintRecordHeader, tombstone), &header.tombstone, sizeof(header.tombstone));
+        std::memcpy(out + offsetof(HintRecordHeader, codec), &header.codec, sizeof(header.codec));
+        std::memcpy(buffer_.data() + offset + sizeof(HintRecordHeader), key.data(), key.size());
+    }
+
+    bool flush(bool force = false) {
+        if (buffer_.empty() || (!force && buffer_.size() < kFlushSize)) {
+            return true;
+        }
+        uint64_t total_written = 0;
+        while (total_written < buffer_.size()) {
+            ssize_t bytes_written = write(fd_, buffer_.data() + total_written, buffer_.size() - total_written);
+            if (bytes_written == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
+                perror("hint write failed");
+                return false;
+            }
+            total_written += bytes_written;
+        }
+        buffer_.clear();
+        return true;
+    }
+
+    // Flushes, syncs and renames the hint file to its final name.
+    bool finish(const std::string &path) {
+        if (!flush(true /* force */)) {
+            return false;
+        }
+        if (fdatasync(fd_) != 0) {
+            perror("hint fdatasync failed");
+            return false;
+        }
+        close(fd_);
+        fd_ = -1;
+        if (rename(file_.c_str(), path.c_str()) != 0) {
+            perror("hint rename failed");
+            return false;
+        }
+        file_ = path;
+        return sync_parent_dir(path);
+    }
+
+    static bool read_all(const std::string &file, std::function<void(const HintRecordHeader &, std::string_view)> callback) {
+        int fd = open(file.c_str(), O_RDONLY);
+        if (fd == -1) {
+            return false;
+        }
+        char magic[sizeof(kMagic)];
+        if (read(fd, magic, sizeof(magic)) != sizeof(magic) || std::memcmp(magic, kMagic, sizeof(kMagic)) != 0) {
+            close(fd);
+            return false;
+        }
+        std::vector<uint8_t> buffer(kReadSize);
+        uint64_t begin = 0;
+        uint64_t end = 0;
+        bool eof = false;
+        bool ok = true;
+        while (true) {
+            auto available = end - begin;
+            HintRecordHeader header;
+            if (available >= sizeof(HintRecordHeader)) {
+                std::memcpy(&header, buffer.data() + begin, sizeof(HintRecordHeader));
+                auto record_size = sizeof(HintRecordHeader) + header.key_size;
+                if (available >= record_size) {
+                    callback(header, std::string_view(reinterpret_cast<char *>(buffer.data() + begin) + sizeof(HintRecordHeader),
+                                                      header.key_size));
+                    begin += record_size;
+                    continue;
+                }
+                if (record_size > buffer.size()) {
+                    buffer.resize(record_size);
+                }
+            }
+            if (eof) {
+                // Anything left over is a truncated hint file.
+                ok = available == 0;
+                break;
+            }
+
+            // Move the partial record to the front and refill.
+            std::memmove(buffer.data(), buffer.data() + begin, available);
+            begin = 0;
+            end = available;
+            ssize_t bytes_read = read(fd, buffer.data() + end, buffer.size() - end);
+            if (bytes_read == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
+                perror("hint read failed");
+                ok = false;
+                break;
+            }
+            eof = bytes_read == 0;
+            end += bytes_read;
+        }
+        close(fd);
+        return ok;
+    }
+
+   private:
+    static constexpr char kMagic[8] = {'B', 'C', 'H', 'I', 'N', 'T', '0', '2'};
+    static constexpr uint64_t kFlushSize = 1024 * 1024;
+    static constexpr uint64_t kReadSize = 1024 * 1024;
+    std::string file_;
+    int32_t fd_ = -1;
+    std::vector<uint8_t> buffer_;
 };
 
 class DataFile {
    public:
     DataFile() = default;
-    DataFile(const std::string &file, uint64_t file_id, bool write) : file_(file), file_id_(file_id), write_(write) {
+    DataFile(const std::string &file, uint64_t file_id, bool write, std::shared_ptr<IoBackend> io = nullptr)
+        : file_(file),
+          file_id_(file_id),
+          write_(write),
+          sealed_(!write),
+          io_(io ? std::move(io) : std::make_shared<PosixIoBackend>()) {
         if (write_) {
-            write_fd_ = open(file_.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+            // Not O_APPEND, writes go to write_offset_ and copy_file_range
+            // refuses appending fds.
+            write_fd_ = open(file_.c_str(), O_WRONLY | O_CREAT, 0644);
             if (write_fd_ == -1) {
                 perror("");
                 throw std::runtime_error("Failed to open file for write");
             }
+            hint_file_ = std::make_unique<HintFile>(file_ + ".hint.tmp");
+            io_->register_file(write_fd_);
         }
         read_fd_ = open(file_.c_str(), O_RDONLY);
         if (read_fd_ == -1) {
             perror("");
             throw std::runtime_error("Failed to open for read");
         }
+        io_->register_file(read_fd_);
+        write_offset_ = size();
+        if (write_ && write_offset_ == 0) {
+            DataFileHeader header;
+            if (!io_->write(write_fd_, 0, reinterpret_cast<const uint8_t *>(&header), sizeof(header))) {
+                throw std::runtime_error("Failed to write data file header");
+            }
+            write_offset_ = sizeof(header);
+            format_ = RecordFormat::kV2;
+            data_start_ = sizeof(header);
+        } else {
+            read_format();
+        }
     }
 
     ~DataFile() {
-        if (write_fd_ != -1) close(write_fd_);
-        if (read_fd_ != -1) close(read_fd_);
+        if (auto map = map_.load()) munmap(map, map_size_);
+        if (write_fd_ != -1) {
+            io_->unregister_file(write_fd_);
+            close(write_fd_);
+        }
+        if (read_fd_ != -1) {
+            io_->unregister_file(read_fd_);
+            close(read_fd_);
+        }
+        if (hint_file_) unlink((file_ + ".hint.tmp").c_str());
     }
 
+    bool sync() {
+        if (write_fd_ == -1) {
+            return true;
+        }
+        return io_->sync(write_fd_);
+    }
+
+    // Stops writes to the file and publishes its hint file at hint_path.
+    // False if the data could not be synced or the hint not written.
+    bool seal(const std::string &hint_path) {
+        if (write_fd_ == -1) {
+            return true;
+        }
+        // The mark goes in only once the records are on disk, so a file
+        // marked sealed never ends in a torn record.
+        auto synced = io_->sync(write_fd_);
+        if (synced && format_ == RecordFormat::kV2) {
+            uint32_t flags = kDataFileSealed;
+            synced = io_->write(write_fd_, offsetof(DataFileHeader, flags), reinterpret_cast<const uint8_t *>(&flags),
+                                sizeof(flags)) &&
+                     io_->sync(write_fd_);
+            marked_sealed_ = synced;
+        }
+        io_->unregister_file(write_fd_);
+        close(write_fd_);
+        write_fd_ = -1;
+        auto ret = synced && hint_file_->finish(hint_path);
+        hint_file_.reset();
+        sealed_.store(true, std::memory_order_release);
+        return ret;
+    }
+
+    // Whether the file takes no more writes, safe to call from any thread.
+    bool sealed() const { return sealed_.load(std::memory_order_acquire); }
+
+    // Whether the file was sealed on disk. A file without the mark was still
+    // being written when the store last stopped, only it can end in a torn
+    // record. Files from before the mark count as sealed.
+    bool marked_sealed() const { return marked_sealed_; }
+
+    // Maps a sealed file read-only, reads within the mapping are then served
+    // by memcpy instead of pread.
+    bool map() {
+        assert(write_fd_ == -1);
+        auto size = this->size();
+        if (size == 0 || map_.load()) {
+            return false;
+        }
+        auto addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, read_fd_, 0);
+        if (addr == MAP_FAILED) {
+            perror("mmap failed");
+            return false;
+        }
+        map_size_ = size;
+        map_.store(static_cast<uint8_t *>(addr), std::memory_order_release);
+        return true;
+    }
+
+    // Returns the mapped bytes of [offset, offset + size), or nullptr when the
+    // range is not mapped.
+    const uint8_t *mapped(uint64_t offset, uint64_t size) const {
+        auto map = map_.load(std::memory_order_acquire);
+        if (!map || offset + size > map_size_) {
+            return nullptr;
+        }
+        return map + offset;
+    }
+
+    // Appends the records, only to v2 files.
     bool write_records(std::vector<DataRecord> &records) {
+        assert(format_ == RecordFormat::kV2);
         uint64_t total_size = 0;
         for (auto &record : records) {
-            total_size += sizeof(DataRecordHeader) + record.key.size() + record.value.size();
+            total_size += record_size(record.seq, record.key.size(), record.value.size());
         }
 
-        uint64_t file_offset = lseek(write_fd_, 0, SEEK_CUR);
-        if (file_offset == -1) {
-            perror("lseek failed");
-            return false;
-        }
+        uint64_t file_offset = write_offset_;
         auto buffer = std::make_unique<uint8_t[]>(total_size);
         auto buffer_ptr = buffer.get();
+        std::vector<HintRecordHeader> hints;
+        hints.reserve(records.size());
         for (auto &record : records) {
             auto &key = record.key;
             auto &value = record.value;
-            record.value_offset = file_offset + sizeof(DataRecordHeader) + key.size();
-            auto header = reinterpret_cast<DataRecordHeader *>(buffer_ptr);
-            header->crc = 0;
-            header->timestamp = 0;
-            header->key_size = key.size();
-            header->value_size = value.size();
-            header->tombstone = record.tombstone;
-            buffer_ptr += sizeof(DataRecordHeader);
+            auto record_start = buffer_ptr;
+            buffer_ptr[4] = kRecordHasCrc | (record.tombstone ? kRecordTombstone : 0);
+            buffer_ptr[5] = record.codec;
+            buffer_ptr = put_varint(buffer_ptr + kV2FixedHeaderSize, record.seq);
+            buffer_ptr = put_varint(buffer_ptr, key.size());
+            buffer_ptr = put_varint(buffer_ptr, value.size());
+            record.value_offset = file_offset + (buffer_ptr - record_start) + key.size();
             std::memcpy(static_cast<uint8_t *>(buffer_ptr), key.data(), key.size());
+            buffer_ptr += key.size();
 
             if (!value.empty()) {
-                buffer_ptr += key.size();
                 std::memcpy(static_cast<uint8_t *>(buffer_ptr), value.data(), value.size());
+                buffer_ptr += value.size();
             }
+            auto crc = record_crc(record_start, buffer_ptr - record_start);
+            std::memcpy(record_start, &crc, sizeof(crc));
 
-            uint64_t record_size = sizeof(DataRecordHeader) + key.size() + value.size();
-            buffer_ptr += record_size;
-            file_offset += record_size;
+            file_offset += buffer_ptr - record_start;
+            hints.push_back(HintRecordHeader{.timestamp = record.seq,
+                                             .value_offset = record.value_offset,
+                                             .key_size = static_cast<uint32_t>(key.size()),
+                                             .value_size = static_cast<uint32_t>(value.size()),
+                                             .tombstone = record.tombstone,
+                                             .codec = record.codec});
+        }
+        if (!write_exact(buffer.get(), total_size)) {
+            return false;
         }
-        return write_exact(buffer.get(), total_size);
+        // Only records that made it to the file get hint entries, a failed
+        // write leaves write_offset_ where it was for the next batch.
+        for (size_t i = 0; i < records.size(); i++) {
+            add_seq(records[i].seq);
+            hint_file_->append(records[i].key, hints[i]);
+        }
+        add_records(records.size(), total_size);
+        return hint_file_->flush();
     }
 
     bool write_exact(uint8_t *buffer, uint64_t size) {
-        uint64_t total_written = 0;
-        while (total_written < size) {
-            ssize_t bytes_written = write(write_fd_, buffer + total_written, size - total_written);
-            if (bytes_written == -1) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) continue;
-                perror("write failed");
-                return false;
-            } else if (bytes_written == 0) {
-                break;
-            }
-            total_written += bytes_written;
+        if (!io_->write(write_fd_, write_offset_, buffer, size)) {
+            return false;
         }
-
-        return total_written == size ? true : false;
+        write_offset_ += size;
+        return true;
     }
 
-    bool read_all_records(std::function<void(const DataRecordHeader &, const DataRecord &)> callback) {
-        uint64_t offset = 0;
-        while (true) {
-            DataRecordHeader header;
-            // Read the header
-            auto ret = read_exact(offset, reinterpret_cast<uint8_t *>(&header), sizeof(header));
+    // Appends the records in [offset, offset + size) of src byte for byte.
+    // hints are the hint entries of those records, their value offsets are
+    // moved to the copy's location.
+    // Both files must have the same format.
+    bool copy_records(const DataFile &src, uint64_t offset, uint64_t size, std::span<HintRecord> hints,
+                      bool kernel_copy = true) {
+        assert(src.format_ == format_);
+        constexpr uint64_t kCopyBufferSize = 1024 * 1024;
+        uint64_t copied = 0;
+        // Let the kernel copy the range, it can skip the trip through user
+        // space or share the extents. Anything it cant do is copied below.
+        while (kernel_copy && copied < size) {
+            loff_t in_offset = offset + copied;
+            loff_t out_offset = write_offset_ + copied;
+            auto ret = copy_file_range(src.read_fd_, &in_offset, write_fd_, &out_offset, size - copied, 0);
             if (ret == -1) {
+                if (errno == EINTR || errno == EAGAIN) continue;
+                if (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL) break;
+                perror("copy_file_range failed");
                 return false;
             } else if (ret == 0) {
                 break;
             }
+            copied += ret;
+        }
+        if (copied < size) {
+            std::vector<uint8_t> buffer(std::min(size - copied, kCopyBufferSize));
+            while (copied < size) {
+                auto chunk = std::min<uint64_t>(buffer.size(), size - copied);
+                if (src.read_exact(offset + copied, buffer.data(), chunk) != chunk ||
+                    !io_->write(write_fd_, write_offset_ + copied, buffer.data(), chunk)) {
+                    return false;
+                }
+                copied += chunk;
+            }
+        }
+
+        for (auto &hint : hints) {
+            add_seq(hint.timestamp);
+            hint.value_offset = hint.value_offset - offset + write_offset_;
+            hint_file_->append(hint.key, HintRecordHeader{.timestamp = hint.timestamp,
+                                                          .value_offset = hint.value_offset,
+                                                          .key_size = static_cast<uint32_t>(hint.key.size()),
+                                                          .value_size = static_cast<uint32_t>(hint.value_size),
+                                                          .tombstone = hint.tombstone,
+                                                          .codec = hint.codec});
+        }
+        write_offset_ += size;
+        add_records(hints.size(), size);
+        return hint_file_->flush();
+    }
+
+    // Checksum of a whole record, header included, as stored in its crc.
+    static uint32_t record_crc(const uint8_t *record, uint64_t size) {
+        return folly::crc32c(record + sizeof(uint32_t), size - sizeof(uint32_t));
+    }
+
+    // Whether a whole record matches its checksum, records written without
+    // one always do.
+    bool verify_record(const uint8_t *record, uint64_t size) const {
+        DataRecordHeader header;
+        if (!decode_header(record, size, header)) {
+            return false;
+        }
+        return !(header.flags & kRecordHasCrc) || header.crc == record_crc(record, size);
+    }
+
+    // Decodes the header of the record at data, of which available bytes
+    // are readable. Returns the header's size, 0 if it is cut short or
+    // malformed.
+    uint64_t decode_header(const uint8_t *data, uint64_t available, DataRecordHeader &header) const {
+        if (format_ == RecordFormat::kV1) {
+            if (available < sizeof(DataRecordHeader)) {
+                return 0;
+            }
+            std::memcpy(&header, data, sizeof(DataRecordHeader));
+            return sizeof(DataRecordHeader);
+        }
+        if (available < kV2FixedHeaderSize) {
+            return 0;
+        }
+        auto end = data + std::min(available, kMaxHeaderSize);
+        header = DataRecordHeader{};
+        std::memcpy(&header.crc, data, sizeof(header.crc));
+        header.flags = data[4];
+        header.tombstone = header.flags & kRecordTombstone;
+        header.codec = data[5];
+        uint64_t key_size = 0;
+        uint64_t value_size = 0;
+        auto ptr = get_varint(data + kV2FixedHeaderSize, end, header.timestamp);
+        ptr = ptr ? get_varint(ptr, end, key_size) : nullptr;
+        ptr = ptr ? get_varint(ptr, end, value_size) : nullptr;
+        if (!ptr || key_size > UINT32_MAX || value_size > UINT32_MAX) {
+            return 0;
+        }
+        header.key_size = key_size;
+        header.value_size = value_size;
+        return ptr - data;
+    }
+
+    // Reads all the records, verifying their checksums. valid_size is set to
+    // the end of the last good record.
+    bool read_all_records(std::function<void(const DataRecordHeader &, const DataRecord &)> callback,
+                          uint64_t *valid_size = nullptr) const {
+        return scan_records(
+            true /* read_values */, true /* verify */,
+            [&](const DataRecordHeader &header, std::string_view key, std::string_view value, uint64_t value_offset) {
+                DataRecord record{.key = std::string(key),
+                                  .value = std::string(value),
+                                  .tombstone = header.tombstone,
+                                  .value_offset = value_offset,
+                                  .seq = header.timestamp,
+                                  .codec = header.codec};
+                callback(header, record);
+                return true;
+            },
+            valid_size);
+    }
+
+    // Walks the records in file order using large buffered reads. Values are
+    // only read when read_values is set, otherwise value is empty. A torn
+    // record at the tail ends the scan, and so does the first record that
+    // fails its checksum when verify is set, or the callback returning false.
+    // valid_size is set to where the scan stopped. Reads are read_size large.
+    bool scan_records(bool read_values, bool verify,
+                      std::function<bool(const DataRecordHeader &, std::string_view key, std::string_view value,
+                                         uint64_t value_offset)>
+                          callback,
+                      uint64_t *valid_size = nullptr, uint64_t read_size = kScanBufferSize) const {
+        std::vector<uint8_t> buffer(read_size);
+        uint64_t file_size = size();
+        uint64_t buffer_offset = 0;
+        uint64_t buffer_size = 0;
+        uint64_t offset = data_start_;
 
-            // Read the whole key value
-            offset += sizeof(header);
-            uint64_t kv_size = header.key_size + header.value_size;
-            auto kv_buffer = std::make_unique<uint8_t[]>(kv_size);
-            ret = read_exact(offset, kv_buffer.get(), kv_size);
+        // Makes [offset, offset + size) available in the buffer.
+        auto fill = [&](uint64_t size) {
+            if (offset >= buffer_offset && offset + size <= buffer_offset + buffer_size) {
+                return true;
+            }
+            if (size > buffer.size()) {
+                buffer.resize(size);
+            }
+            auto ret = read_exact(offset, buffer.data(), std::min<uint64_t>(buffer.size(), file_size - offset));
             if (ret == -1) {
                 return false;
             }
+            buffer_offset = offset;
+            buffer_size = ret;
+            return size <= buffer_size;
+        };
 
-            std::string tkey;
-            tkey.assign(reinterpret_cast<char *>(kv_buffer.get()), header.key_size);
-            offset += header.key_size;
-            std::string tvalue;
-            tvalue.assign(reinterpret_cast<char *>(kv_buffer.get()), header.value_size);
-            uint64_t value_offset = offset;
-            offset += header.value_size;
+        while (offset < file_size) {
+            if (!fill(std::min(kMaxHeaderSize, file_size - offset))) {
+                return false;
+            }
+            DataRecordHeader header;
+            auto header_size = decode_header(buffer.data() + (offset - buffer_offset),
+                                             buffer_offset + buffer_size - offset, header);
+            uint64_t record_size = header_size + header.key_size + header.value_size;
+            if (!header_size || offset + record_size > file_size) {
+                break;
+            }
+            bool check = verify && (header.flags & kRecordHasCrc);
+            if (!fill(header_size + header.key_size + (read_values || check ? header.value_size : 0))) {
+                return false;
+            }
 
-            DataRecord record{.key = tkey, .value = tvalue, .value_offset = value_offset};
-            callback(header, record);
+            auto data = reinterpret_cast<const char *>(buffer.data() + (offset - buffer_offset));
+            if (check && !verify_record(reinterpret_cast<const uint8_t *>(data), record_size)) {
+                break;
+            }
+            std::string_view key(data + header_size, header.key_size);
+            std::string_view value;
+            if (read_values) {
+                value = std::string_view(data + header_size + header.key_size, header.value_size);
+            }
+            if (!callback(header, key, value, offset + header_size + header.key_size)) {
+                break;
+            }
+            offset += record_size;
+        }
+        if (valid_size) {
+            *valid_size = offset;
         }
         return true;
     }
 
     uint64_t read_exact(uint64_t offset, uint8_t *buffer, uint64_t size) const {
-        int total_read = 0;
-        while (total_read < size) {
-            ssize_t bytes_read = pread(read_fd_, buffer + total_read, size - total_read, offset);
-            if (bytes_read == 0) {
-                break;
-            } else if (bytes_read == -1) {
-                if (errno == EAGAIN || errno == EWOULDBLOCK) continue;
-                perror("read failed");
-                return -1;
-            }
-
-            total_read += bytes_read;
+        if (auto map = map_.load(std::memory_order_acquire); map && offset < map_size_) {
+            auto length = std::min(size, map_size_ - offset);
+            std::memcpy(buffer, map + offset, length);
+            return length;
         }
 
-        return total_read;
+        return io_->read(read_fd_, offset, buffer, size);
+    }
+
+    // The read of [offset, offset + size) as an op for IoBackend::read_batch.
+    // Mapped files are better served by read_exact.
+    ReadOp read_op(uint64_t offset, uint8_t *buffer, uint64_t size) const {
+        return ReadOp{.fd = read_fd_, .offset = offset, .buffer = buffer, .size = size};
     }
 
-    uint64_t size() {
+    uint64_t size() const {
         struct stat st;
-        if (fstat(write_fd_, &st) != 0) {
+        if (fstat(read_fd_, &st) != 0) {
             perror("fstat error");
             return 0;
         }
         return st.st_size;
     }
 
-    uint64_t id() { return file_id_; }
-    std::string name() { return file_; }
+    // Cuts the file back to size, dropping a damaged tail.
+    bool truncate(uint64_t size) {
+        if (::truncate(file_.c_str(), size) != 0) {
+            perror("truncate failed");
+            return false;
+        }
+        write_offset_ = size;
+        return true;
+    }
+
+    uint64_t id() const { return file_id_; }
+    std::string name() const { return file_; }
 
-    void inc_dead_records() {
-        dead_records_++;
-        num_records_++;
+    void rename(const std::string &path) {
+        std::filesystem::rename(file_, path);
+        file_ = path;
     }
 
-    void inc_num_records() {
-        num_records_++;
+    RecordFormat format() const { return format_; }
+
+    // Tells the kernel the file is about to be read front to back, for more
+    // read-ahead, or that reads are back to random.
+    void advise_sequential(bool sequential) const {
+        posix_fadvise(read_fd_, 0, 0, sequential ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_NORMAL);
+        if (auto map = map_.load(std::memory_order_acquire)) {
+            madvise(map, map_size_, sequential ? MADV_SEQUENTIAL : MADV_NORMAL);
+        }
     }
 
-    double dead_record_ratio() {
-        return (double)dead_records_ / num_records_;
+    // A pinned file is left alone by compaction.
+    void pin() { pins_.fetch_add(1, std::memory_order_relaxed); }
+    void unpin() { pins_.fetch_sub(1, std::memory_order_relaxed); }
+    bool pinned() const { return pins_.load(std::memory_order_relaxed) > 0; }
+
+    // Bytes the header of a record takes in this file.
+    uint64_t header_size(uint64_t seq, uint64_t key_size, uint64_t value_size) const {
+        if (format_ == RecordFormat::kV1) {
+            return sizeof(DataRecordHeader);
+        }
+        return kV2FixedHeaderSize + varint_size(seq) + varint_size(key_size) + varint_size(value_size);
+    }
+
+    // Bytes a record takes in this file.
+    uint64_t record_size(uint64_t seq, uint64_t key_size, uint64_t value_size) const {
+        return header_size(seq, key_size, value_size) + key_size + value_size;
+    }
+
+    // Counts records written to the file, or found in it at load.
+    void add_records(uint64_t count, uint64_t bytes) {
+        total_records_.fetch_add(count, std::memory_order_relaxed);
+        total_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    // Counts records that have been overwritten or removed since, tombstones
+    // are dead from the start.
+    void add_dead_records(uint64_t count, uint64_t bytes) {
+        dead_records_.fetch_add(count, std::memory_order_relaxed);
+        dead_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    // Counts tombstones, which are dead from the start. Compaction may still
+    // have to keep them while an older put of their key is around.
+    void add_tombstones(uint64_t count, uint64_t bytes) {
+        add_dead_records(count, bytes);
+        tombstone_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    uint64_t live_records() const { return total_records_.load() - dead_records_.load(); }
+    uint64_t dead_records() const { return dead_records_.load(); }
+    uint64_t live_bytes() const { return total_bytes_.load() - dead_bytes_.load(); }
+    uint64_t dead_bytes() const { return dead_bytes_.load(); }
+
+    // Tracks the lowest sequence number in the file.
+    void add_seq(uint64_t seq) {
+        auto min_seq = min_seq_.load(std::memory_order_relaxed);
+        while (seq < min_seq && !min_seq_.compare_exchange_weak(min_seq, seq, std::memory_order_relaxed)) {
+        }
+    }
+    uint64_t min_seq() const { return min_seq_.load(std::memory_order_relaxed); }
+
+    double dead_ratio() const {
+        auto total_bytes = total_bytes_.load();
+        return total_bytes ? static_cast<double>(dead_bytes_.load()) / total_bytes : 0;
+    }
+
+    // Dead bytes a rewrite of the file reclaims for sure, without tombstones.
+    uint64_t garbage_bytes() const { return dead_bytes_.load() - tombstone_bytes_.load(); }
+    double garbage_ratio() const {
+        auto total_bytes = total_bytes_.load();
+        return total_bytes ? static_cast<double>(garbage_bytes()) / total_bytes : 0;
     }
 
    private:
-    uint64_t num_records_ = 0;
-    uint64_t dead_records_ = 0;
+    // crc, flags and codec of a v2 header, the varints follow.
+    static constexpr uint64_t kV2FixedHeaderSize = 6;
+    // Largest header in either format.
+    static constexpr uint64_t kMaxHeaderSize = sizeof(DataRecordHeader);
+    static constexpr uint64_t kScanBufferSize = 1024 * 1024;
+
+    // Files that start with a DataFileHeader are v2, older ones v1.
+    void read_format() {
+        DataFileHeader header;
+        DataFileHeader expected;
+        if (io_->read(read_fd_, 0, reinterpret_cast<uint8_t *>(&header), sizeof(header)) != sizeof(header) ||
+            std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0) {
+            marked_sealed_ = true;
+            return;
+        }
+        if (header.version != static_cast<uint32_t>(RecordFormat::kV2)) {
+            throw std::runtime_error("Unsupported data file version " + std::to_string(header.version));
+        }
+        format_ = RecordFormat::kV2;
+        data_start_ = sizeof(header);
+        marked_sealed_ = header.flags & kDataFileSealed;
+    }
+
+    std::atomic<uint64_t> total_records_ = 0;
+    std::atomic<uint64_t> total_bytes_ = 0;
+    std::atomic<uint64_t> dead_records_ = 0;
+    std::atomic<uint64_t> dead_bytes_ = 0;
+    std::atomic<uint64_t> tombstone_bytes_ = 0;
+    std::atomic<uint64_t> min_seq_ = UINT64_MAX;
+    std::atomic<uint32_t> pins_ = 0;
     std::string file_;
     int32_t write_fd_ = -1;
     int32_t read_fd_ = -1;
+    std::unique_ptr<HintFile> hint_file_;
+    std::atomic<uint8_t *> map_ = nullptr;
+    uint64_t map_size_ = 0;
+    // Only touched by the thread writing the file.
+    uint64_t write_offset_ = 0;
     uint64_t file_id_;
+    RecordFormat format_ = RecordFormat::kV1;
+    // Offset of the first record.
+    uint64_t data_start_ = 0;
     bool write_ = false;
+    std::atomic<bool> sealed_ = false;
+    bool marked_sealed_ = false;
+    std::shared_ptr<IoBackend> io_;
 };
 
 }  // namespace bitcask
\ No newline at end of file
@@ -0,0 +1,225 @@
+/**
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "bitcask.hpp"
+#include "key_dir.hpp"
+namespace bitcask {
+
+// Sharded CLOCK cache of values for hot keys, bounded by a byte budget.
+//
+// Every entry remembers the (file_id, value_offset) it was read from and a
+// lookup only hits when that matches the caller's current KeyDirEntry, so the
+// cache can never return a value the KeyDir has moved past. Writers still
+// update or drop entries to keep the memory for live values.
+class ValueCache {
+   public:
+    using Value = std::shared_ptr<const std::string>;
+
+    explicit ValueCache(uint64_t capacity_bytes) : shard_capacity_(capacity_bytes / kNumShards) {}
+
+    Value get(std::string_view key, const KeyDirEntry& entry) {
+        auto& shard = shard_for(key);
+        std::lock_guard lock(shard.mutex);
+        auto iter = shard.index.find(key);
+        if (iter == shard.index.end()) {
+            shard.misses++;
+            return nullptr;
+        }
+        auto& slot = shard.slots[iter->second];
+        if (slot.file_id != entry.file_id || slot.value_offset != entry.value_offset) {
+            shard.misses++;
+            return nullptr;
+        }
+        slot.referenced = true;
+        shard.hits++;
+        return slot.value;
+    }
+
+    // Adds a value read from disk at entry's location.
+    void insert(std::string_view key, const KeyDirEntry& entry, std::string_view value) {
+        auto size = charge(key, value.size());
+        if (size > shard_capacity_) {
+            return;
+        }
+        auto& shard = shard_for(key);
+        auto cached = std::make_shared<const std::string>(value);
+        std::lock_guard lock(shard.mutex);
+        auto iter = shard.index.find(key);
+        if (iter != shard.index.end()) {
+            auto& slot = shard.slots[iter->second];
+            shard.bytes -= charge(slot.key, slot.value->size());
+            slot.value = std::move(cached);
+            slot.file_id = entry.file_id;
+            slot.value_offset = entry.value_offset;
+            shard.bytes += size;
+            evict(shard);
+            return;
+        }
+
+        evict(shard, size);
+        uint64_t index;
+        if (shard.free_slots.empty()) {
+            index = shard.slots.size();
+            shard.slots.emplace_back();
+        } else {
+            index = shard.free_slots.back();
+            shard.free_slots.pop_back();
+        }
+        auto& slot = shard.slots[index];
+        slot.key = std::string(key);
+        slot.value = std::move(cached);
+        slot.file_id = entry.file_id;
+        slot.value_offset = entry.value_offset;
+        slot.referenced = false;
+        slot.used = true;
+        shard.index.emplace(slot.key, index);
+        shard.bytes += size;
+    }
+
+    // Replaces the value of a cached key after a put, keys that are not cached
+    // are left alone so writes dont pollute the cache.
+    void update(std::string_view key, const KeyDirEntry& entry, std::string_view value) {
+        auto& shard = shard_for(key);
+        {
+            std::lock_guard lock(shard.mutex);
+            if (shard.index.find(key) == shard.index.end()) {
+                return;
+            }
+        }
+        insert(key, entry, value);
+    }
+
+    // Points a cached value at its new location after compaction moved it.
+    // A cached value from any other location is stale and is dropped.
+    void relocate(std::string_view key, const KeyDirEntry& old_entry, const KeyDirEntry& new_entry) {
+        auto& shard = shard_for(key);
+        std::lock_guard lock(shard.mutex);
+        auto iter = shard.index.find(key);
+        if (iter == shard.index.end()) {
+            return;
+        }
+        auto& slot = shard.slots[iter->second];
+        if (slot.file_id == old_entry.file_id && slot.value_offset == old_entry.value_offset) {
+            slot.file_id = new_entry.file_id;
+            slot.value_offset = new_entry.value_offset;
+        } else {
+            remove_slot(shard, iter->second);
+        }
+    }
+
+    void erase(std::string_view key) {
+        auto& shard = shard_for(key);
+        std::lock_guard lock(shard.mutex);
+        auto iter = shard.index.find(key);
+        if (iter != shard.index.end()) {
+            remove_slot(shard, iter->second);
+        }
+    }
+
+    CacheStats stats() const {
+        CacheStats stats;
+        for (auto& shard : shards_) {
+            std::lock_guard lock(shard.mutex);
+            stats.hits += shard.hits;
+            stats.misses += shard.misses;
+            stats.evictions += shard.evictions;
+            stats.entries += shard.index.size();
+            stats.bytes += shard.bytes;
+        }
+        return stats;
+    }
+
+   private:
+    struct Slot {
+        std::string key;
+        Value value;
+        uint64_t file_id = 0;
+        uint64_t value_offset = 0;
+        bool referenced = false;
+        bool used = false;
+    };
+
+    struct Shard {
+        mutable std::mutex mutex;
+        // Keys point into the slot's key, a deque never moves its elements.
+        std::unordered_map<std::string_view, uint64_t> index;
+        std::deque<Slot> slots;
+        std::vector<uint64_t> free_slots;
+        uint64_t hand = 0;
+        uint64_t bytes = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+    };
+
+    static constexpr uint64_t kNumShards = 32;
+    // Rough bookkeeping cost of an entry on top of its key and value.
+    static constexpr uint64_t kEntryOverhead = 96;
+
+    static uint64_t charge(std::string_view key, uint64_t value_size) { return key.size() + value_size + kEntryOverhead; }
+
+    Shard& shard_for(std::string_view key) { return shards_[std::hash<std::string_view>{}(key) % kNumShards]; }
+
+    void remove_slot(Shard& shard, uint64_t index) {
+        auto& slot = shard.slots[index];
+        shard.index.erase(slot.key);
+        shard.bytes -= charge(slot.key, slot.value->size());
+        slot = Slot{};
+        shard.free_slots.push_back(index);
+    }
+
+    // Sweeps the clock hand until there is room for incoming more bytes,
+    // giving referenced entries a second chance.
+    void evict(Shard& shard, uint64_t incoming = 0) {
+        while (shard.bytes + incoming > shard_capacity_ && !shard.index.empty()) {
+            if (shard.hand >= shard.slots.size()) {
+                shard.hand = 0;
+            }
+            auto& slot = shard.slots[shard.hand];
+            if (slot.used) {
+                if (slot.referenced) {
+                    slot.referenced = false;
+                } else {
+                    remove_slot(shard, shard.hand);
+                    shard.evictions++;
+                }
+            }
+            shard.hand++;
+        }
+    }
+
+    uint64_t shard_capacity_;
+    std::array<Shard, kNumShards> shards_;
+};
+}  // namespace bitcask
@@ -0,0 +1,303 @@
+/**
+The MIT License (MIT)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#pragma once
+#include <fcntl.h>
+#include <folly/compression/Compression.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifdef BITCASK_WITH_ZSTD_DICT
+#include <zdict.h>
+#include <zstd.h>
+
+#include <atomic>
+#include <fstream>
+#include <iterator>
+#include <thread>
+#endif
+
+#include "bitcask.hpp"
+#include "storage.hpp"
+namespace bitcask {
+
+// Codec of a stored value, kept in the record and hint headers and the KeyDir.
+enum RecordCodec : uint8_t {
+    kRaw = 0,
+    kLZ4 = 1,
+    kZstd = 2,
+    // zstd with the store's trained dictionary.
+    kZstdDict = 3,
+};
+
+// Compresses values on the write path and decompresses them on reads. Safe to
+// use from any thread, codec contexts are kept per thread.
+class ValueCodec {
+   public:
+    ValueCodec(const Params &params, const std::string &dict_path)
+        : compression_(params.compression),
+          min_value_size_(params.compression_min_value_size),
+          dict_size_(params.compression_dict_bytes),
+          dict_path_(dict_path) {
+        if (compression_ == Compression::kLZ4 && !folly::io::hasCodec(folly::io::CodecType::LZ4_VARINT_SIZE)) {
+            std::cout << "folly built without lz4, values are stored uncompressed" << std::endl;
+            compression_ = Compression::kNone;
+        }
+        if ((compression_ == Compression::kZstd || compression_ == Compression::kZstdDict) &&
+            !folly::io::hasCodec(folly::io::CodecType::ZSTD)) {
+            std::cout << "folly built without zstd, values are stored uncompressed" << std::endl;
+            compression_ = Compression::kNone;
+        }
+#ifdef BITCASK_WITH_ZSTD_DICT
+        load_dict();
+#else
+        if (compression_ == Compression::kZstdDict) {
+            std::cout << "bitcask built without zstd dictionaries, using plain zstd" << std::endl;
+            compression_ = Compression::kZstd;
+        }
+#endif
+    }
+
+    ~ValueCodec() {
+#ifdef BITCASK_WITH_ZSTD_DICT
+        if (train_thread_.joinable()) {
+            train_thread_.join();
+        }
+        ZSTD_freeCDict(cdict_.load());
+        ZSTD_freeDDict(ddict_.load());
+#endif
+    }
+
+    // Encodes value into out. Returns the codec used, kRaw when compression
+    // is off, the value is small or it does not get any smaller.
+    uint8_t compress(std::string_view value, std::string &out) {
+        if (compression_ == Compression::kNone || value.size() < min_value_size_) {
+            return kRaw;
+        }
+        uint8_t codec = kRaw;
+        try {
+            if (compression_ == Compression::kLZ4) {
+                out = folly_codec(kLZ4)->compress(value);
+                codec = kLZ4;
+            } else {
+#ifdef BITCASK_WITH_ZSTD_DICT
+                if (compression_ == Compression::kZstdDict && value.size() <= kMaxDictValueSize &&
+                    compress_with_dict(value, out)) {
+                    codec = kZstdDict;
+                }
+#endif
+                if (codec == kRaw) {
+                    out = folly_codec(kZstd)->compress(value);
+                    codec = kZstd;
+                }
+            }
+        } catch (const std::exception &e) {
+            std::cout << "Compression failed: " << e.what() << std::endl;
+            return kRaw;
+        }
+        return out.size() < value.size() ? codec : kRaw;
+    }
+
+    // Decodes a value stored with codec into out, false if it is corrupt.
+    bool decompress(uint8_t codec, std::string_view stored, std::string &out) const {
+        try {
+            switch (codec) {
+                case kRaw:
+                    out.assign(stored);
+                    return true;
+                case kLZ4:
+                case kZstd:
+                    out = folly_codec(codec)->uncompress(stored);
+                    return true;
+#ifdef BITCASK_WITH_ZSTD_DICT
+                case kZstdDict:
+                    return decompress_with_dict(stored, out);
+#endif
+                default:
+                    std::cout << "Unsupported value codec " << static_cast<int>(codec) << std::endl;
+                    return false;
+            }
+        } catch (const std::exception &e) {
+            std::cout << "Decompression failed: " << e.what() << std::endl;
+            return false;
+        }
+    }
+
+    // Whether compaction should re-encode a value stored with codec, because
+    // the store now compresses differently.
+    bool stale(uint8_t codec, uint64_t stored_size) const {
+        switch (compression_) {
+            case Compression::kNone:
+                return codec != kRaw;
+            case Compression::kLZ4:
+                return codec != kLZ4 && (codec != kRaw || stored_size >= min_value_size_);
+            default:
+                return codec != kZstd && codec != kZstdDict && (codec != kRaw || stored_size >= min_value_size_);
+        }
+    }
+
+   private:
+    // Values up to this size are compressed with the dictionary.
+    static constexpr uint64_t kMaxDictValueSize = 4096;
+    // The dictionary is trained once this many times its size in samples are in.
+    static constexpr uint64_t kDictSampleRatio = 100;
+
+    static folly::io::Codec *folly_codec(uint8_t codec) {
+        thread_local std::unique_ptr<folly::io::Codec> lz4;
+        thread_local std::unique_ptr<folly::io::Codec> zstd;
+        auto &ret = codec == kLZ4 ? lz4 : zstd;
+        if (!ret) {
+            ret = folly::io::getCodec(codec == kLZ4 ? folly::io::CodecType::LZ4_VARINT_SIZE : folly::io::CodecType::ZSTD);
+        }
+        return ret.get();
+    }
+
+#ifdef BITCASK_WITH_ZSTD_DICT
+    // A store keeps the first dictionary it trains, every kZstdDict value
+    // depends on it. It is synced to disk before any value uses it.
+    void load_dict() {
+        std::ifstream file(dict_path_, std::ios::binary);
+        if (!file) {
+            return;
+        }
+        std::string dict((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        set_dict(dict);
+    }
+
+    void set_dict(const std::string &dict) {
+        ddict_.store(ZSTD_createDDict(dict.data(), dict.size()));
+        cdict_.store(ZSTD_createCDict(dict.data(), dict.size(), kDictLevel), std::memory_order_release);
+    }
+
+    bool save_dict(const std::string &dict) {
+        auto tmp_path = dict_path_ + ".tmp";
+        int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            perror("dictionary open failed");
+            return false;
+        }
+        bool ok = write(fd, dict.data(), dict.size()) == static_cast<ssize_t>(dict.size()) && fdatasync(fd) == 0;
+        close(fd);
+        if (!ok || rename(tmp_path.c_str(), dict_path_.c_str()) != 0) {
+            perror("dictionary write failed");
+            return false;
+        }
+        return sync_parent_dir(dict_path_);
+    }
+
+    // Collects value as a training sample, and starts training the
+    // dictionary once there are enough of them. Training takes a while, so it
+    // runs on its own thread and values keep using plain zstd meanwhile.
+    void add_sample(std::string_view value) {
+        std::lock_guard lock(dict_mutex_);
+        if (dict_failed_ || training_ || cdict_.load()) {
+            return;
+        }
+        samples_.append(value);
+        sample_sizes_.emplace_back(value.size());
+        if (samples_.size() < dict_size_ * kDictSampleRatio) {
+            return;
+        }
+        training_ = true;
+        train_thread_ = std::thread([this, samples = std::move(samples_), sample_sizes = std::move(sample_sizes_)] {
+            train_dict(samples, sample_sizes);
+        });
+    }
+
+    void train_dict(const std::string &samples, const std::vector<size_t> &sample_sizes) {
+        std::string dict(dict_size_, '\0');
+        auto size =
+            ZDICT_trainFromBuffer(dict.data(), dict.size(), samples.data(), sample_sizes.data(), sample_sizes.size());
+        if (ZDICT_isError(size)) {
+            std::cout << "zstd dictionary training failed: " << ZDICT_getErrorName(size) << std::endl;
+            std::lock_guard lock(dict_mutex_);
+            dict_failed_ = true;
+            return;
+        }
+        dict.resize(size);
+        if (!save_dict(dict)) {
+            std::lock_guard lock(dict_mutex_);
+            dict_failed_ = true;
+            return;
+        }
+        set_dict(dict);
+    }
+
+    bool compress_with_dict(std::string_view value, std::string &out) {
+        auto cdict = cdict_.load(std::memory_order_acquire);
+        if (!cdict) {
+            add_sample(value);
+            return false;
+        }
+        thread_local std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> cctx(ZSTD_createCCtx(), ZSTD_freeCCtx);
+        out.resize(ZSTD_compressBound(value.size()));
+        auto size = ZSTD_compress_usingCDict(cctx.get(), out.data(), out.size(), value.data(), value.size(), cdict);
+        if (ZSTD_isError(size)) {
+            return false;
+        }
+        out.resize(size);
+        return true;
+    }
+
+    bool decompress_with_dict(std::string_view stored, std::string &out) const {
+        auto ddict = ddict_.load(std::memory_order_acquire);
+        if (!ddict) {
+            std::cout << "Value needs the zstd dictionary, which is missing" << std::endl;
+            return false;
+        }
+        auto size = ZSTD_getFrameContentSize(stored.data(), stored.size());
+        if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR) {
+            return false;
+        }
+        thread_local std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+        out.resize(size);
+        auto ret = ZSTD_decompress_usingDDict(dctx.get(), out.data(), out.size(), stored.data(), stored.size(), ddict);
+        return !ZSTD_isError(ret) && ret == size;
+    }
+
+    static constexpr int kDictLevel = 3;
+    std::mutex dict_mutex_;
+    std::string samples_;
+    std::vector<size_t> sample_sizes_;
+    bool training_ = false;
+    bool dict_failed_ = false;
+    std::thread train_thread_;
+    std::atomic<ZSTD_CDict *> cdict_ = nullptr;
+    std::atomic<ZSTD_DDict *> ddict_ = nullptr;
+#endif
+
+    Compression compression_;
+    uint64_t min_value_size_;
+    uint64_t dict_size_;
+    std::string dict_path_;
+};
+
+}  // namespace bitcask
@@ -1,20 +1,27 @@
 
+#include <folly/executors/CPUThreadPoolExecutor.h>
 #include <gflags/gflags.h>
 #include <gtest/gtest.h>
+#include <sys/stat.h>
 
 #include <bitcask.hpp>
 #include <cassert>
 #include <chrono>
 #include <filesystem>
+#include <format>
+#include <fstream>
 #include <iostream>
+#include <map>
 #include <random>
+#include <set>
 #include <string>
 
 using namespace std;
 using namespace bitcask;
 DEFINE_int32(num_kvs, 1000, "Number of kvs used for testing.");
 const char* test_dir_ = "/tmp/bc_test_dir";
-class BitCaskTest : public ::testing::Test {
+// Every test runs against each I/O backend the library is built with.
+class BitCaskTest : public ::testing::TestWithParam<IoBackendType> {
    public:
     BitCaskTest() : rng_(chrono::high_resolution_clock::now().time_since_epoch().count()), char_dist_(32, 126) {}
     void SetUp() override {}
@@ -33,6 +40,34 @@ class BitCaskTest : public ::testing::Test {
         return random_string;
     }
 
+    // params with the backend under test, unless the test picked one.
+    Params with_backend(Params params) {
+        if (params.io_backend == IoBackendType::kPosix) {
+            params.io_backend = GetParam();
+        }
+        return params;
+    }
+
+    // Polls cond until it holds, false if it still does not after timeout.
+    static bool eventually(const function<bool()>& cond, chrono::milliseconds timeout = chrono::seconds(30)) {
+        auto deadline = chrono::steady_clock::now() + timeout;
+        while (!cond()) {
+            if (chrono::steady_clock::now() > deadline) {
+                return false;
+            }
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+        return true;
+    }
+
+    // Waits for passes more background compaction passes to complete. The
+    // first may have started before the call, later ones see the store as
+    // it is now.
+    static bool wait_for_compaction(BitCask& bc, uint64_t passes = 2) {
+        auto target = bc.stats().compaction_passes + passes;
+        return eventually([&]() { return bc.stats().compaction_passes >= target; });
+    }
+
     string random_key() { return generate_random_string(16, 128); }
     string random_value() { return generate_random_string(128, 1024); }
     vector<pair<string, string>> generate_random_kvs(int count) {
@@ -49,11 +84,19 @@ class BitCaskTest : public ::testing::Test {
     uniform_int_distribution<int> char_dist_;
 };
 
-TEST_F(BitCaskTest, put_test) {
+#ifdef BITCASK_WITH_IO_URING
+INSTANTIATE_TEST_SUITE_P(Backends, BitCaskTest, ::testing::Values(IoBackendType::kPosix, IoBackendType::kIoUring),
+                         [](const auto& info) { return info.param == IoBackendType::kPosix ? "Posix" : "IoUring"; });
+#else
+INSTANTIATE_TEST_SUITE_P(Backends, BitCaskTest, ::testing::Values(IoBackendType::kPosix),
+                         [](const auto& info) { return "Posix"; });
+#endif
+
+TEST_P(BitCaskTest, put_test) {
     int count = FLAGS_num_kvs;
     auto kvs = generate_random_kvs(count);
     {
-        BitCask bc(test_dir_, Params{});
+        BitCask bc(test_dir_, with_backend(Params{}));
         for (auto& [key, value] : kvs) {
             ASSERT_EQ(bc.put(key, value).get(), true);
         }
@@ -64,18 +107,18 @@ TEST_F(BitCaskTest, put_test) {
     }
 
     {
-        BitCask bc(test_dir_, Params{});
+        BitCask bc(test_dir_, with_backend(Params{}));
         for (auto& [key, value] : kvs) {
             ASSERT_EQ(bc.get(key).value(), value);
         }
     }
 }
 
-TEST_F(BitCaskTest, update_test) {
+TEST_P(BitCaskTest, update_test) {
     int count = FLAGS_num_kvs;
     auto kvs = generate_random_kvs(count);
     {
-        BitCask bc(test_dir_, Params{});
+        BitCask bc(test_dir_, with_backend(Params{}));
         for (auto& [key, value] : kvs) {
             ASSERT_EQ(bc.put(key, value).get(), true);
         }
@@ -99,18 +142,18 @@ TEST_F(BitCaskTest, update_test) {
     }
 
     {
-        BitCask bc(test_dir_, Params{});
+        BitCask bc(test_dir_, with_backend(Params{}));
         for (auto& [key, value] : kvs) {
             ASSERT_EQ(bc.get(key).value(), value);
         }
     }
 }
 
-TEST_F(BitCaskTest, remove_test) {
+TEST_P(BitCaskTest, remove_test) {
     int count = FLAGS_num_kvs;
     auto kvs = generate_random_kvs(count);
     {
-        BitCask bc(test_dir_, Params{});
+        BitCask bc(test_dir_, with_backend(Params{}));
         for (auto& [key, value] : kvs) {
             ASSERT_EQ(bc.put(key, value).get(), true);
         }
@@ -137,7 +180,7 @@ TEST_F(BitCaskTest, remove_test) {
     }
 
     {
-        BitCask bc(test_dir_, Params{});
+        BitCask bc(test_dir_, with_backend(Params{}));
         for (int i = 0; i < kvs.size() / 2; i++) {
             ASSERT_EQ(bc.get(kvs[i].first).has_value(), false);
         }
@@ -148,7 +191,1245 @@ TEST_F(BitCaskTest, remove_test) {
     }
 }
 
+TEST_P(BitCaskTest, concurrent_put_test) {
+    int count = FLAGS_num_kvs;
+    auto kvs = generate_random_kvs(count);
+    {
+        BitCask bc(test_dir_, with_backend(Params{}));
+        // Enqueue all puts before waiting so they get grouped into batches.
+        vector<future<bool>> futures;
+        futures.reserve(kvs.size());
+        for (auto& [key, value] : kvs) {
+            futures.emplace_back(bc.put(key, value));
+        }
+        for (auto& future : futures) {
+            ASSERT_EQ(future.get(), true);
+        }
+
+        for (auto& [key, value] : kvs) {
+            ASSERT_EQ(bc.get(key).value(), value);
+        }
+    }
+
+    {
+        BitCask bc(test_dir_, with_backend(Params{}));
+        for (auto& [key, value] : kvs) {
+            ASSERT_EQ(bc.get(key).value(), value);
+        }
+    }
+}
+
+TEST_P(BitCaskTest, write_batch_test) {
+    int count = FLAGS_num_kvs;
+    auto kvs = generate_random_kvs(count);
+    {
+        BitCask bc(test_dir_, with_backend(Params{}));
+        WriteBatch batch;
+        for (auto& [key, value] : kvs) {
+            batch.put(key, value);
+        }
+        ASSERT_EQ(bc.write(std::move(batch)).get(), true);
+
+        // Remove the first half and update the second half in one batch.
+        WriteBatch update;
+        for (int i = 0; i < kvs.size(); i++) {
+            if (i < kvs.size() / 2) {
+                update.remove(kvs[i].first);
+            } else {
+                kvs[i].second = random_value();
+                update.put(kvs[i].first, kvs[i].second);
+            }
+        }
+        ASSERT_EQ(bc.write(std::move(update)).get(), true);
+
+        for (int i = 0; i < kvs.size() / 2; i++) {
+            ASSERT_EQ(bc.get(kvs[i].first).has_value(), false);
+        }
+        for (int i = kvs.size() / 2; i < kvs.size(); i++) {
+            ASSERT_EQ(bc.get(kvs[i].first).value(), kvs[i].second);
+        }
+    }
+
+    {
+        BitCask bc(test_dir_, with_backend(Params{}));
+        for (int i = 0; i < kvs.size() / 2; i++) {
+            ASSERT_EQ(bc.get(kvs[i].first).has_value(), false);
+        }
+        for (int i = kvs.size() / 2; i < kvs.size(); i++) {
+            ASSERT_EQ(bc.get(kvs[i].first).value(), kvs[i].second);
+        }
+    }
+}
+
+TEST_P(BitCaskTest, multi_get_test) {
+    int count = FLAGS_num_kvs;
+    auto kvs = generate_random_kvs(count);
+    BitCask bc(test_dir_, with_backend(Params{}));
+    for (auto& [key, value] : kvs) {
+        ASSERT_EQ(bc.put(key, value).get(), true);
+    }
+
+    // Mix in keys that dont exist.
+    vector<string> keys;
+    for (auto& [key, value] : kvs) {
+        keys.emplace_back(key);
+        keys.emplace_back(key + "_missing");
+    }
+    auto values = bc.multi_get(keys);
+    ASSERT_EQ(values.size(), keys.size());
+    for (int i = 0; i < kvs.size(); i++) {
+        ASSERT_EQ(values[2 * i].value(), kvs[i].second);
+        ASSERT_EQ(values[2 * i + 1].has_value(), false);
+    }
+}
+
+TEST_P(BitCaskTest, hint_file_test) {
+    int count = FLAGS_num_kvs;
+    auto kvs = generate_random_kvs(count);
+    Params params{.max_data_file_size = 64 * 1024};
+    {
+        BitCask bc(test_dir_, with_backend(params));
+        for (auto& [key, value] : kvs) {
+            ASSERT_EQ(bc.put(key, value).get(), true);
+        }
+        for (int i = 0; i < kvs.size() / 2; i++) {
+            ASSERT_EQ(bc.remove(kvs[i].first).get(), true);
+        }
+    }
+
+    // Every data file is sealed with a hint file.
+    vector<filesystem::path> hint_files;
+    for (auto& entry : filesystem::directory_iterator(test_dir_)) {
+        if (entry.path().extension() == ".data") {
+            auto hint_path = entry.path();
+            hint_path.replace_extension(".hint");
+            ASSERT_TRUE(filesystem::exists(hint_path));
+            hint_files.emplace_back(hint_path);
+        }
+    }
+    ASSERT_GT(hint_files.size(), 1);
+
+    // Missing hint files fall back to scanning the data file, and are written
+    // again byte for byte.
+    string hint_data;
+    {
+        ifstream in(hint_files[0], ios::binary);
+        hint_data.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    }
+    filesystem::remove(hint_files[0]);
+    for (int reopen = 0; reopen < 2; reopen++) {
+        BitCask bc(test_dir_, with_backend(params));
+        for (int i = 0; i < kvs.size() / 2; i++) {
+            ASSERT_EQ(bc.get(kvs[i].first).has_value(), false);
+        }
+        for (int i = kvs.size() / 2; i < kvs.size(); i++) {
+            ASSERT_EQ(bc.get(kvs[i].first).value(), kvs[i].second);
+        }
+    }
+    ifstream in(hint_files[0], ios::binary);
+    ASSERT_EQ(string(istreambuf_iterator<char>(in), istreambuf_iterator<char>()), hint_data);
+}
+
+TEST_P(BitCaskTest, parallel_load_test) {
+    int count = FLAGS_num_kvs;
+    auto kvs = generate_random_kvs(count);
+    Params params{.max_data_file_size = 32 * 1024, .load_threads = 4};
+    {
+        BitCask bc(test_dir_, with_backend(params));
+        for (auto& [key, value] : kvs) {
+            ASSERT_EQ(bc.put(key, value).get(), true);
+        }
+        // Overwrite and remove keys so the latest versions live in later files.
+        for (auto& [key, value] : kvs) {
+            value = random_value();
+            ASSERT_EQ(bc.put(key, value).get(), true);
+        }
+        for (int i = 0; i < kvs.size() / 2; i++) {
+            ASSERT_EQ(bc.remove(kvs[i].first).get(), true);
+        }
+    }
+
+    {
+        BitCask bc(test_dir_, with_backend(params));
+        for (int i = 0; i < kvs.size() / 2; i++) {
+            ASSERT_EQ(bc.get(kvs[i].first).has_value(), false);
+        }
+        for (int i = kvs.size() / 2; i < kvs.size(); i++) {
+            ASSERT_EQ(bc.get(kvs[i].first).value(), kvs[i].second);
+        }
+    }
+}
+
+TEST_P(BitCaskTest, mmap_reads_test) {
+    int count = FLAGS_num_kvs;
+    auto kvs = generate_random_kvs(count);
+    Params params{.max_data_file_size = 64 * 1024, .mmap_reads = true};
+    {
+        BitCask bc(test_dir_, with_backend(params));
+        for (auto& [key, value] : kvs) {
+            ASSERT_EQ(bc.put(key, value).get(), true);
+        }
+        // Most of the values are in sealed and mapped files by now.
+        for (auto& [key, value] : kvs) {
+            ASSERT_EQ(bc.get(key).value(), value);
+        }
+    }
+
+    {
+        BitCask bc(test_dir_, with_backend(params));
+        vector<string> keys;
+        for (auto& [key, value] : kvs) {
+            ASSERT_EQ(bc.get(key).value(), value);
+            keys.emplace_back(key);
+        }
+        auto values = bc.multi_get(keys);
+        for (int i = 0; i < kvs.size(); i++) {
+            ASSERT_EQ(values[i].value(), kvs[i].second);
+        }
+    }
+}
+
+TEST_P(BitCaskTest, zero_copy_get_test) {
+    int count = FLAGS_num_kvs;
+    auto kvs = generate_random_kvs(count);
+    for (bool mmap_reads : {false, true}) {
+        BitCask bc(test_dir_, with_backend(Params{.max_data_file_size = 64 * 1024, .mmap_reads = mmap_reads}));
+        for (auto& [key, value] : kvs) {
+            ASSERT_EQ(bc.put(key, value).get(), true);
+        }
+
+        vector<char> buffer(2048);
+        for (auto& [key, value] : kvs) {
+            ASSERT_EQ(bc.get_into(key, buffer).value(), value.size());
+            ASSERT_EQ(string_view(buffer.data(), value.size()), value);
+            // Too small a buffer only reports the size.
+            ASSERT_EQ(bc.get_into(key, span<char>(buffer.data(), 1)).value(), value.size());
+
+            string result;
+            ASSERT_TRUE(bc.get_with(key, [&](string_view v) { result = v; }));
+            ASSERT_EQ(result, value);
+        }
+        ASSERT_FALSE(bc.get_into("missing_key", buffer).has_value());
+        ASSERT_FALSE(bc.get_with("missing_key", [](string_view) {}));
+    }
+}
+
+TEST_P(BitCaskTest, value_cache_test) {
+    int count = FLAGS_num_kvs;
+    auto kvs = generate_random_kvs(count);
+    BitCask bc(test_dir_, with_backend(Params{.value_cache_bytes = 64 * 1024 * 1024}));
+    for (auto& [key, value] : kvs) {
+        ASSERT_EQ(bc.put(key, value).get(), true);
+    }
+
+    // First read misses and fills the cache, second read hits.
+    for (int round = 0; round < 2; round++) {
+        for (auto& [key, value] : kvs) {
+            ASSERT_EQ(bc.get(key).value(), value);
+        }
+    }
+    auto stats = bc.cache_stats();
+    ASSERT_EQ(stats.misses, kvs.size());
+    ASSERT_EQ(stats.hits, kvs.size());
+    ASSERT_EQ(stats.entries, kvs.size());
+
+    // Updates and removes never leave a stale value behind.
+    for (int i = 0; i < kvs.size(); i++) {
+        if (i % 2) {
+            ASSERT_EQ(bc.remove(kvs[i].first).get(), true);
+        } else {
+            kvs[i].second = random_value();
+            ASSERT_EQ(bc.put(kvs[i].first, kvs[i].second).get(), true);
+        }
+    }
+    for (int i = 0; i < kvs.size(); i++) {
+        if (i % 2) {
+            ASSERT_EQ(bc.get(kvs[i].first).has_value(), false);
+        } else {
+            ASSERT_EQ(bc.get(kvs[i].first).value(), kvs[i].second);
+        }
+    }
+}
+
+TEST_P(BitCaskTest, fsync_mode_test) {
+    int count = FLAGS_num_kvs;
+    auto kvs = generate_random_kvs(count);
+    {
+        BitCask bc(test_dir_, with_backend(Params{.max_data_file_size = 64 * 1024, .fsync_mode = true}));
+        vector<future<bool>> futures;
+        for (auto& [key, value] : kvs) {
+            futures.emplace_back(bc.put(key, value));
+        }
+        for (auto& future : futures) {
+            ASSERT_EQ(future.get(), true);
+        }
+    }
+
+    {
+        BitCask bc(test_dir_, with_backend(Params{}));
+        for (auto& [key, value] : kvs) {
+            ASSERT_EQ(bc.get(key).value(), value);
+        }
+    }
+}
+
+TEST_P(BitCaskTest, file_ids_exhausted_test) {
+    Params params{.max_data_file_size = 4 * 1024};
+    {
+        BitCask bc(test_dir_, with_backend(params));
+        ASSERT_TRUE(bc.put("key0", "value0").get());
+    }
+    // Move the data to the next to last id the KeyDir can hold.
+    auto path = filesystem::path(test_dir_);
+    filesystem::rename(path / "000000001.data", path / "4294967294.data");
+    filesystem::rename(path / "000000001.hint", path / "4294967294.hint");
+
+    // Once the last file is full, puts fail instead of bringing the process down.
+    BitCask bc(test_dir_, with_backend(params));
+    string value(1024, 'x');
+    int written = 0;
+    while (written < 100 && bc.put("key" + to_string(written + 1), value).get()) {
+        written++;
+    }
+    ASSERT_GT(written, 0);
+    ASSERT_LT(written, 100);
+    ASSERT_EQ(bc.get("key0").value(), "value0");
+    for (int i = 1; i <= written; i++) {
+        ASSERT_EQ(bc.get("key" + to_string(i)).value(), value);
+    }
+}
+
+TEST_P(BitCaskTest, io_uring_backend_test) {
+    int count = FLAGS_num_kvs;
+    auto kvs = generate_random_kvs(count);
+    // Falls back to the posix backend when built without io_uring.
+    Params params{.max_data_file_size = 64 * 1024, .fsync_mode = true, .io_backend = IoBackendType::kIoUring};
+    {
+        BitCask bc(test_dir_, with_backend(params));
+        vector<future<bool>> futures;
+        for (auto& [key, value] : kvs) {
+            futures.emplace_back(bc.put(key, value));
+        }
+        for (auto& future : futures) {
+            ASSERT_EQ(future.get(), true);
+        }
+    }
+
+    BitCask bc(test_dir_, with_backend(params));
+    vector<string> keys;
+    for (auto& [key, value] : kvs) {
+        ASSERT_EQ(bc.get(key).value(), value);
+        keys.emplace_back(key);
+    }
+    auto values = bc.multi_get(keys);
+    for (int i = 0; i < kvs.size(); i++) {
+        ASSERT_EQ(values[i].value(), kvs[i].second);
+    }
+}
+
+TEST_P(BitCaskTest, merge_test) {
+    int count = FLAGS_num_kvs;
+    auto kvs = generate_random_kvs(count);
+    auto count_data_files = [&]() {
+        int data_files = 0;
+        for (auto& entry : filesystem::directory_iterator(test_dir_)) {
+            data_files += entry.path().extension() == ".data";
+        }
+        return data_files;
+    };
+    {
+        BitCask bc(test_dir_, with_backend(Params{.max_data_file_size = 64 * 1024}));
+        for (auto& [key, value] : kvs) {
+            ASSERT_EQ(bc.put(key, value).get(), true);
+        }
+        // Leave a quarter of the keys live.
+        for (int i = 0; i < kvs.size(); i++) {
+            if (i % 4) {
+                ASSERT_EQ(bc.remove(kvs[i].first).get(), true);
+            }
+        }
+    }
+
+    auto before = count_data_files();
+    {
+        BitCask bc(test_dir_, with_backend(Params{.max_data_file_size = 64 * 1024, .compaction_interval_secs = 1}));
+        ASSERT_TRUE(eventually([&]() { return count_data_files() < before; }));
+        for (int i = 0; i < kvs.size(); i++) {
+            ASSERT_EQ(bc.get(kvs[i].first), i % 4 ? nullopt : optional<string>(kvs[i].second));
+        }
+    }
+
+    BitCask bc(test_dir_, with_backend(Params{.max_data_file_size = 64 * 1024}));
+    for (int i = 0; i < kvs.size(); i++) {
+        ASSERT_EQ(bc.get(kvs[i].first), i % 4 ? nullopt : optional<string>(kvs[i].second));
+    }
+}
+
+TEST_P(BitCaskTest, compact_tombstone_file_test) {
+    Params params{.max_data_file_size = 4 * 1024};
+    {
+        BitCask bc(test_dir_, with_backend(params));
+        ASSERT_EQ(bc.put("victim", "value").get(), true);
+        for (int i = 0; i < 12; i++) {
+            ASSERT_EQ(bc.put("filler" + to_string(i), string(1024, 'a')).get(), true);
+        }
+    }
+    // A file of its own whose only record is a tombstone compaction has to
+    // keep, since an older file still holds the put.
+    {
+        BitCask bc(test_dir_, with_backend(params));
+        ASSERT_EQ(bc.remove("victim").get(), true);
+    }
+
+    // Compaction settles instead of rewriting that file at every interval.
+    params.compaction_interval_secs = 1;
+    BitCask bc(test_dir_, with_backend(params));
+    ASSERT_TRUE(wait_for_compaction(bc));
+    auto merges = bc.stats().merges;
+    ASSERT_TRUE(wait_for_compaction(bc));
+    ASSERT_EQ(bc.stats().merges, merges);
+    ASSERT_FALSE(bc.get("victim").has_value());
+}
+
+TEST_P(BitCaskTest, merge_keeps_tombstones_test) {
+    auto first_file = filesystem::path(test_dir_) / "000000001.data";
+    auto backup = filesystem::path(test_dir_ + string(".backup"));
+    auto fillers = 40;
+    {
+        BitCask bc(test_dir_, with_backend(Params{.max_data_file_size = 4 * 1024}));
+        ASSERT_EQ(bc.put("victim", "value").get(), true);
+        for (int i = 0; i < fillers; i++) {
+            ASSERT_EQ(bc.put("filler" + to_string(i), string(1024, 'a')).get(), true);
+        }
+        ASSERT_EQ(bc.remove("victim").get(), true);
+        for (int i = 0; i < fillers; i++) {
+            ASSERT_EQ(bc.remove("filler" + to_string(i)).get(), true);
+        }
+    }
+    filesystem::create_directory(backup);
+    filesystem::copy(first_file, backup / first_file.filename());
+
+    // Merge every file, then put the first one back as if a crash had left it
+    // behind while the inputs holding the tombstones were already unlinked.
+    {
+        BitCask bc(test_dir_, with_backend(Params{.max_data_file_size = 4 * 1024, .compaction_interval_secs = 1}));
+        ASSERT_TRUE(eventually([&]() { return !filesystem::exists(first_file); }));
+    }
+    filesystem::copy(backup / first_file.filename(), first_file);
+    filesystem::remove_all(backup);
+
+    BitCask bc(test_dir_, with_backend(Params{}));
+    ASSERT_FALSE(bc.get("victim").has_value());
+    for (int i = 0; i < fillers; i++) {
+        ASSERT_FALSE(bc.get("filler" + to_string(i)).has_value());
+    }
+}
+
+TEST_P(BitCaskTest, compact_dead_ratio_test) {
+    int count = FLAGS_num_kvs;
+    auto kvs = generate_random_kvs(count);
+    Params params{.max_data_file_size = 64 * 1024};
+    {
+        BitCask bc(test_dir_, with_backend(params));
+        for (auto& [key, value] : kvs) {
+            ASSERT_EQ(bc.put(key, value).get(), true);
+        }
+    }
+
+    // Inode of every data file, rewritten files get a new one.
+    auto data_files = [&]() {
+        map<string, ino_t> inodes;
+        for (auto& entry : filesystem::directory_iterator(test_dir_)) {
+            struct stat st;
+            if (entry.path().extension() == ".data" && stat(entry.path().c_str(), &st) == 0) {
+                inodes[entry.path().filename()] = st.st_ino;
+            }
+        }
+        return inodes;
+    };
+    auto before = data_files();
+
+    params.compaction_interval_secs = 1;
+    BitCask bc(test_dir_, with_backend(params));
+    // Files without garbage are left alone.
+    ASSERT_TRUE(wait_for_compaction(bc, 1));
+    for (auto& [name, inode] : before) {
+        ASSERT_EQ(data_files()[name], inode);
+    }
+
+    // Overwriting the first half of the keys turns the oldest files into garbage.
+    for (int i = 0; i < kvs.size() / 2; i++) {
+        kvs[i].second = random_value();
+        ASSERT_EQ(bc.put(kvs[i].first, kvs[i].second).get(), true);
+    }
+    auto& [oldest, oldest_inode] = *before.begin();
+    ASSERT_TRUE(eventually([&]() { return data_files()[oldest] != oldest_inode; }));
+    for (auto& [key, value] : kvs) {
+        ASSERT_EQ(bc.get(key).value(), value);
+    }
+}
+
+TEST_P(BitCaskTest, compact_copy_runs_test) {
+    // The live half of the oldest file is one 2MB stretch of records, which
+    // compaction copies as several runs of at most 1MB.
+    constexpr int kCount = 512;
+    vector<pair<string, string>> kvs;
+    for (int i = 0; i < kCount; i++) {
+        kvs.emplace_back("key" + to_string(i), generate_random_string(8192, 8192));
+    }
+    for (bool kernel_copy : {true, false}) {
+        filesystem::remove_all(test_dir_);
+        Params params{.max_data_file_size = 4 * 1024 * 1024};
+        {
+            BitCask bc(test_dir_, with_backend(params));
+            for (auto& [key, value] : kvs) {
+                ASSERT_EQ(bc.put(key, value).get(), true);
+            }
+        }
+        auto oldest = string(test_dir_) + "/000000001.data";
+        struct stat st;
+        ASSERT_EQ(stat(oldest.c_str(), &st), 0);
+        auto oldest_inode = st.st_ino;
+
+        params.compaction_interval_secs = 1;
+        params.compaction_kernel_copy = kernel_copy;
+        {
+            BitCask bc(test_dir_, with_backend(params));
+            for (int i = kCount / 2; i < kCount; i++) {
+                kvs[i].second = generate_random_string(8192, 8192);
+                ASSERT_EQ(bc.put(kvs[i].first, kvs[i].second).get(), true);
+            }
+            ASSERT_TRUE(eventually([&]() { return stat(oldest.c_str(), &st) != 0 || st.st_ino != oldest_inode; }));
+            for (auto& [key, value] : kvs) {
+                ASSERT_EQ(bc.get(key).value(), value);
+            }
+        }
+
+        // The relocated offsets in the hint files point at the copied records.
+        params.compaction_interval_secs = 0;
+        params.verify_checksums = true;
+        BitCask bc(test_dir_, with_backend(params));
+        for (auto& [key, value] : kvs) {
+            ASSERT_EQ(bc.get(key).value(), value);
+        }
+    }
+}
+
+TEST_P(BitCaskTest, compaction_rate_test) {
+    int count = FLAGS_num_kvs;
+    auto kvs = generate_random_kvs(count);
+    auto count_data_files = [&]() {
+        int data_files = 0;
+        for (auto& entry : filesystem::directory_iterator(test_dir_)) {
+            data_files += entry.path().extension() == ".data";
+        }
+        return data_files;
+    };
+    {
+        BitCask bc(test_dir_, with_backend(Params{.max_data_file_size = 64 * 1024}));
+        for (auto& [key, value] : kvs) {
+            ASSERT_EQ(bc.put(key, value).get(), true);
+        }
+        for (int i = 0; i < kvs.size(); i++) {
+            if (i % 4) {
+                ASSERT_EQ(bc.remove(kvs[i].first).get(), true);
+            }
+        }
+    }
+
+    BitCask bc(test_dir_, with_backend(Params{.max_data_file_size = 64 * 1024,
+                                              .compaction_interval_secs = 1,
+                                              .compaction_rate_bytes_per_sec = 1}));
+    auto before = count_data_files();
+    // At a byte per second the first merge gets its first run through on the
+    // initial burst and then cant finish.
+    ASSERT_TRUE(eventually([&]() { return bc.stats().compaction_bytes_read > 0; }));
+    ASSERT_EQ(bc.stats().merges, 0);
+    ASSERT_EQ(count_data_files(), before);
+
+    // Lifting the limit lets the current merge finish, then compaction stays
+    // paused. Staying put can only be watched for a while.
+    bc.pause_compaction();
+    bc.set_compaction_rate(0);
+    ASSERT_TRUE(eventually([&]() { return bc.stats().merges == 1; }));
+    ASSERT_FALSE(eventually([&]() { return bc.stats().merges > 1; }, chrono::milliseconds(300)));
+
+    bc.resume_compaction();
+    ASSERT_TRUE(eventually([&]() { return bc.stats().merges > 1; }));
+    ASSERT_TRUE(eventually([&]() { return count_data_files() < before; }));
+    for (int i = 0; i < kvs.size(); i++) {
+        ASSERT_EQ(bc.get(kvs[i].first), i % 4 ? nullopt : optional<string>(kvs[i].second));
+    }
+}
+
+TEST_P(BitCaskTest, write_lanes_test) {
+    int count = FLAGS_num_kvs;
+    auto kvs = generate_random_kvs(count);
+    map<string, optional<string>> expected;
+    auto check = [&](BitCask& bc) {
+        for (auto& [key, value] : expected) {
+            ASSERT_EQ(bc.get(key), value);
+        }
+    };
+    {
+        BitCask bc(test_dir_, with_backend(Params{.max_data_file_size = 64 * 1024, .write_lanes = 4}));
+        vector<future<bool>> futures;
+        for (auto& [key, value] : kvs) {
+            futures.emplace_back(bc.put(key, value));
+            expected[key] = value;
+        }
+        for (auto& future : futures) {
+            ASSERT_EQ(future.get(), true);
+        }
+
+        // Batches span lanes, their records must still win over the puts
+        // before them and lose to the ones after them after a reopen.
+        for (int i = 0; i + 8 <= kvs.size(); i += 8) {
+            WriteBatch batch;
+            for (int j = i; j < i + 8; j++) {
+                if (j % 3 == 0) {
+                    batch.remove(kvs[j].first);
+                    expected[kvs[j].first] = nullopt;
+                } else {
+                    auto value = random_value();
+                    batch.put(kvs[j].first, value);
+                    expected[kvs[j].first] = value;
+                }
+            }
+            ASSERT_EQ(bc.write(std::move(batch)).get(), true);
+        }
+        futures.clear();
+        for (int i = 0; i < kvs.size(); i += 2) {
+            auto value = random_value();
+            futures.emplace_back(bc.put(kvs[i].first, value));
+            expected[kvs[i].first] = value;
+        }
+        for (auto& future : futures) {
+            ASSERT_EQ(future.get(), true);
+        }
+        check(bc);
+
+        // The same holds for writes still queued when the batch is.
+        futures.clear();
+        for (int i = 0; i + 8 <= kvs.size(); i += 8) {
+            for (int j = i; j < i + 8; j++) {
+                auto value = random_value();
+                futures.emplace_back(bc.put(kvs[j].first, value));
+                expected[kvs[j].first] = value;
+            }
+            WriteBatch batch;
+            for (int j = i; j < i + 8; j++) {
+                auto value = random_value();
+                batch.put(kvs[j].first, value);
+                expected[kvs[j].first] = value;
+            }
+            futures.emplace_back(bc.write(std::move(batch)));
+            auto value = random_value();
+            futures.emplace_back(bc.put(kvs[i].first, value));
+            expected[kvs[i].first] = value;
+        }
+        for (auto& future : futures) {
+            ASSERT_EQ(future.get(), true);
+        }
+        check(bc);
+    }
+
+    {
+        BitCask bc(test_dir_, with_backend(Params{.max_data_file_size = 64 * 1024, .write_lanes = 1}));
+        check(bc);
+    }
+    BitCask bc(test_dir_, with_backend(Params{.max_data_file_size = 64 * 1024, .write_lanes = 3}));
+    check(bc);
+}
+
+TEST_P(BitCaskTest, lock_free_read_test) {
+    // Readers run against batch writes and compaction, and must always see
+    // every batch whole.
+    constexpr int kKeys = 64;
+    vector<string> keys;
+    for (int i = 0; i < kKeys; i++) {
+        keys.emplace_back("key" + to_string(i));
+    }
+    BitCask bc(test_dir_,
+               with_backend(Params{.max_data_file_size = 16 * 1024, .compaction_interval_secs = 1, .write_lanes = 2}));
+    auto write_round = [&](int round) {
+        WriteBatch batch;
+        for (auto& key : keys) {
+            batch.put(key, to_string(round) + string(100, 'x'));
+        }
+        return bc.write(std::move(batch)).get();
+    };
+    ASSERT_EQ(write_round(0), true);
+
+    atomic<bool> stop = false;
+    atomic<int> torn = 0;
+    vector<thread> readers;
+    for (int t = 0; t < 4; t++) {
+        readers.emplace_back([&, t]() {
+            while (!stop.load()) {
+                if (t % 2) {
+                    auto values = bc.multi_get(keys);
+                    for (auto& value : values) {
+                        torn += !value || value != values[0];
+                    }
+                } else {
+                    torn += !bc.get(keys[t]).has_value();
+                }
+            }
+        });
+    }
+    for (int round = 1; round < 2000; round++) {
+        ASSERT_EQ(write_round(round), true);
+    }
+    stop = true;
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    ASSERT_EQ(torn.load(), 0);
+    ASSERT_EQ(bc.get(keys[0]).value(), "1999" + string(100, 'x'));
+}
+
+TEST_P(BitCaskTest, compression_test) {
+    auto json_value = [&](int i) {
+        return "{\"id\": " + to_string(i) + ", \"name\": \"user" + to_string(i) +
+               "\", \"tags\": [\"alpha\", \"beta\", \"gamma\"], \"note\": \"" + to_string(i * 7919) + "\", \"bio\": \"" +
+               string(200, 'a' + i % 26) + "\"}";
+    };
+    auto data_bytes = [&]() {
+        uint64_t bytes = 0;
+        for (auto& entry : filesystem::directory_iterator(test_dir_)) {
+            bytes += entry.path().extension() == ".data" ? entry.file_size() : 0;
+        }
+        return bytes;
+    };
+    int count = FLAGS_num_kvs;
+    for (auto compression : {Compression::kLZ4, Compression::kZstd, Compression::kZstdDict}) {
+        filesystem::remove_all(test_dir_);
+        vector<string> keys;
+        map<string, string> kvs;
+        uint64_t raw_bytes = 0;
+        for (int i = 0; i < count; i++) {
+            keys.emplace_back("key" + to_string(i));
+            kvs[keys.back()] = json_value(i);
+            raw_bytes += kvs[keys.back()].size();
+        }
+        auto check = [&](BitCask& bc) {
+            for (auto& [key, value] : kvs) {
+                ASSERT_EQ(bc.get(key), value);
+                string buffer(16, '\0');
+                auto size = bc.get_into(key, buffer);
+                ASSERT_EQ(size, value.size());
+                buffer.resize(*size);
+                ASSERT_EQ(bc.get_into(key, buffer), value.size());
+                ASSERT_EQ(buffer, value);
+                ASSERT_TRUE(bc.get_with(key, [&](string_view v) { ASSERT_EQ(v, value); }));
+            }
+            auto values = bc.multi_get(keys);
+            for (size_t i = 0; i < keys.size(); i++) {
+                ASSERT_EQ(values[i], kvs[keys[i]]);
+            }
+        };
+
+        Params params{.compression = compression, .compression_dict_bytes = 1024};
+        {
+            BitCask bc(test_dir_, with_backend(params));
+            for (auto& [key, value] : kvs) {
+                ASSERT_EQ(bc.put(key, value).get(), true);
+            }
+            check(bc);
+        }
+        ASSERT_LT(data_bytes(), raw_bytes / 2);
+        {
+            BitCask bc(test_dir_, with_backend(params));
+            check(bc);
+        }
+
+        // Compaction re-encodes the values it moves once compression is off.
+        {
+            BitCask bc(test_dir_, with_backend(Params{.max_data_file_size = 64 * 1024, .compaction_interval_secs = 1}));
+            for (int i = 0; i < count; i += 2) {
+                kvs[keys[i]] = json_value(i + 1);
+                ASSERT_EQ(bc.put(keys[i], kvs[keys[i]]).get(), true);
+            }
+            ASSERT_TRUE(eventually([&]() { return bc.stats().merges > 0; }));
+            check(bc);
+        }
+        BitCask bc(test_dir_, with_backend(Params{}));
+        check(bc);
+    }
+}
+
+TEST_P(BitCaskTest, checksum_test) {
+    int count = 1000;
+    auto value_of = [](int i) { return "value" + to_string(i) + string(64, 'v'); };
+    // Every key is written to the first data file. Later opens add files of
+    // their own, so it is picked by name.
+    auto data_path = [&]() { return filesystem::path(test_dir_) / "000000001.data"; };
+    // Offset of the value of key i in the data file.
+    auto find_value = [&](int i) {
+        ifstream file(data_path(), ios::binary);
+        string data((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+        auto pos = data.find(value_of(i));
+        EXPECT_NE(pos, string::npos);
+        return pos;
+    };
+    // Flips a byte of the value of key i in place.
+    auto corrupt = [&](int i) {
+        auto pos = find_value(i);
+        fstream file(data_path(), ios::in | ios::out | ios::binary);
+        file.seekp(pos + 1);
+        file.put(value_of(i)[1] ^ 0x20);
+        return pos;
+    };
+    // Sets or clears the sealed flag, the last 4 bytes of the file header.
+    auto mark_sealed = [&](uint32_t sealed) {
+        fstream file(data_path(), ios::in | ios::out | ios::binary);
+        file.seekp(12);
+        file.write(reinterpret_cast<const char*>(&sealed), sizeof(sealed));
+    };
+    {
+        BitCask bc(test_dir_, with_backend(Params{}));
+        for (int i = 0; i < count; i++) {
+            ASSERT_EQ(bc.put("key" + to_string(i), value_of(i)).get(), true);
+        }
+    }
+
+    // In a file that was still being written, a bad record and the torn bytes
+    // after it are cut off at recovery.
+    auto path = data_path();
+    mark_sealed(0);
+    filesystem::remove(filesystem::path(path).replace_extension(".hint"));
+    auto bad_offset = corrupt(count - 1);
+    auto prev_end = find_value(count - 2) + value_of(count - 2).size();
+    {
+        ofstream file(path, ios::app | ios::binary);
+        file << "torn";
+    }
+    {
+        BitCask bc(test_dir_, with_backend(Params{}));
+        for (int i = 0; i < count - 1; i++) {
+            ASSERT_EQ(bc.get("key" + to_string(i)), value_of(i));
+        }
+        ASSERT_EQ(bc.get("key" + to_string(count - 1)), nullopt);
+    }
+    // The records are back to back, so the bad one started right after the
+    // previous value.
+    ASSERT_EQ(filesystem::file_size(path), prev_end);
+    ASSERT_LT(prev_end, bad_offset);
+
+    // With verify_checksums, gets of a damaged value miss instead of
+    // returning it.
+    corrupt(count / 2);
+    auto bad_key = "key" + to_string(count / 2);
+    {
+        BitCask bc(test_dir_, with_backend(Params{}));
+        ASSERT_NE(bc.get(bad_key), value_of(count / 2));
+        ASSERT_TRUE(bc.get(bad_key).has_value());
+    }
+    // Mapped records are checked in place.
+    for (bool mmap_reads : {false, true}) {
+        BitCask bc(test_dir_, with_backend(Params{.mmap_reads = mmap_reads, .verify_checksums = true}));
+        ASSERT_EQ(bc.get(bad_key), nullopt);
+        string buffer(1024, '\0');
+        ASSERT_EQ(bc.get_into(bad_key, buffer), nullopt);
+        ASSERT_FALSE(bc.get_with(bad_key, [](string_view) {}));
+        vector<string> keys;
+        for (int i = 0; i < count - 1; i++) {
+            keys.emplace_back("key" + to_string(i));
+        }
+        auto values = bc.multi_get(keys);
+        for (int i = 0; i < count - 1; i++) {
+            if (i == count / 2) {
+                ASSERT_EQ(values[i], nullopt);
+            } else {
+                ASSERT_EQ(values[i], value_of(i));
+                ASSERT_EQ(bc.get(keys[i]), value_of(i));
+                ASSERT_TRUE(bc.get_with(keys[i], [&](string_view v) { ASSERT_EQ(v, value_of(i)); }));
+            }
+        }
+    }
+
+    // A sealed file is never cut short. Without its hint file it loads only
+    // up to a bad record, and the file is left as it is for the next open.
+    mark_sealed(1);
+    auto hint_path = filesystem::path(path).replace_extension(".hint");
+    filesystem::remove(hint_path);
+    for (int reopen = 0; reopen < 2; reopen++) {
+        BitCask bc(test_dir_, with_backend(Params{}));
+        for (int i = 0; i < count - 1; i++) {
+            ASSERT_EQ(bc.get("key" + to_string(i)), i < count / 2 ? optional(value_of(i)) : nullopt);
+        }
+    }
+    ASSERT_EQ(filesystem::file_size(path), prev_end);
+    ASSERT_FALSE(filesystem::exists(hint_path));
+}
+
+TEST_P(BitCaskTest, record_format_test) {
+    int count = 1000;
+    auto key_of = [](int i) { return format("{:020}", i); };
+    auto value_of = [](int i, int version) { return to_string(version) + string(98, 'a' + i % 26) + "v"; };
+    auto data_files = [&]() {
+        vector<filesystem::path> paths;
+        for (auto& entry : filesystem::directory_iterator(test_dir_)) {
+            if (entry.path().extension() == ".data") {
+                paths.emplace_back(entry.path());
+            }
+        }
+        return paths;
+    };
+    auto starts_with_magic = [](const filesystem::path& path) {
+        ifstream file(path, ios::binary);
+        string magic(6, '\0');
+        file.read(magic.data(), magic.size());
+        return magic == "BCDATA";
+    };
+
+    // Records of the v1 format have a fixed 32-byte header and no file header.
+    filesystem::create_directories(test_dir_);
+    {
+        struct V1Header {
+            uint32_t crc = 0;
+            uint64_t timestamp = 0;
+            uint32_t key_size;
+            uint32_t value_size;
+            bool tombstone;
+            uint8_t codec = 0;
+            uint8_t flags = 0;
+        };
+        static_assert(sizeof(V1Header) == 32);
+        ofstream file(filesystem::path(test_dir_) / "000000001.data", ios::binary);
+        auto append = [&](const string& key, const string& value, bool tombstone) {
+            V1Header header{.key_size = static_cast<uint32_t>(key.size()),
+                            .value_size = static_cast<uint32_t>(value.size()),
+                            .tombstone = tombstone};
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            file << key << value;
+        };
+        for (int i = 0; i < count; i++) {
+            append(key_of(i), value_of(i, 0), false);
+        }
+        append(key_of(0), "", true);
+        append(key_of(1), value_of(1, 1), false);
+    }
+    map<string, string> kvs;
+    for (int i = 2; i < count; i++) {
+        kvs[key_of(i)] = value_of(i, 0);
+    }
+    kvs[key_of(1)] = value_of(1, 1);
+    auto check = [&](BitCask& bc) {
+        ASSERT_EQ(bc.get(key_of(0)), nullopt);
+        for (auto& [key, value] : kvs) {
+            ASSERT_EQ(bc.get(key), value);
+        }
+    };
+
+    // New writes go to v2 files, whose records are much smaller.
+    {
+        BitCask bc(test_dir_, with_backend(Params{}));
+        check(bc);
+        for (int i = count; i < 2 * count; i++) {
+            kvs[key_of(i)] = value_of(i, 2);
+            ASSERT_EQ(bc.put(key_of(i), kvs[key_of(i)]).get(), true);
+        }
+        check(bc);
+    }
+    for (auto& path : data_files()) {
+        if (path.filename() == "000000001.data") {
+            ASSERT_FALSE(starts_with_magic(path));
+        } else {
+            ASSERT_TRUE(starts_with_magic(path));
+            ASSERT_LT(filesystem::file_size(path), count * (20 + 100 + 12) + 16);
+        }
+    }
+
+    // Compaction rewrites the v1 file in the v2 format.
+    {
+        BitCask bc(test_dir_, with_backend(Params{.compaction_interval_secs = 1}));
+        ASSERT_TRUE(eventually([&]() {
+            auto paths = data_files();
+            return all_of(paths.begin(), paths.end(), starts_with_magic);
+        }));
+        check(bc);
+    }
+    BitCask bc(test_dir_, with_backend(Params{}));
+    check(bc);
+}
+
+TEST_P(BitCaskTest, ordered_index_test) {
+    int count = 1000;
+    map<string, string> kvs;
+    auto expected = [&](const string& begin, const string& end, size_t limit) {
+        vector<pair<string, string>> ret;
+        for (auto iter = kvs.lower_bound(begin); iter != kvs.end() && (end.empty() || iter->first < end); ++iter) {
+            if (limit && ret.size() >= limit) break;
+            ret.emplace_back(*iter);
+        }
+        return ret;
+    };
+    auto check = [&](BitCask& bc) {
+        ASSERT_EQ(bc.prefix_scan("user:"), expected("user:", "user;", 0));
+        ASSERT_EQ(bc.prefix_scan("item:"), expected("item:", "item;", 0));
+        ASSERT_EQ(bc.prefix_scan("user:00012"), expected("user:00012", "user:00013", 0));
+        ASSERT_EQ(bc.prefix_scan("none"), expected("none", "nonf", 0));
+        ASSERT_EQ(bc.scan("item:00500", "user:00100", 0), expected("item:00500", "user:00100", 0));
+        ASSERT_EQ(bc.scan("user:00900", "", 0), expected("user:00900", "", 0));
+        ASSERT_EQ(bc.scan("", "", 10), expected("", "", 10));
+        ASSERT_EQ(bc.prefix_scan("", 0).size(), kvs.size());
+    };
+    Params params{.max_data_file_size = 64 * 1024, .ordered_index = true};
+    {
+        BitCask bc(test_dir_, with_backend(params));
+        for (int i = 0; i < count; i++) {
+            for (auto prefix : {"user:", "item:"}) {
+                auto key = prefix + format("{:05}", i);
+                kvs[key] = "value" + to_string(i);
+                ASSERT_EQ(bc.put(key, kvs[key]).get(), true);
+            }
+        }
+        for (int i = 0; i < count; i += 3) {
+            auto key = "user:" + format("{:05}", i);
+            kvs.erase(key);
+            ASSERT_EQ(bc.remove(key).get(), true);
+        }
+        check(bc);
+    }
+    {
+        BitCask bc(test_dir_, with_backend(params));
+        check(bc);
+    }
+    BitCask bc(test_dir_, with_backend(Params{}));
+    ASSERT_THROW(bc.scan("", ""), runtime_error);
+}
+
+TEST_P(BitCaskTest, scan_limit_test) {
+    // Keys still in the index whose values are gone, here damaged ones with
+    // verify_checksums, are left out of a page and it reads on past them.
+    constexpr int kCount = 100;
+    auto key_of = [](int i) { return format("key{:05}", i); };
+    auto value_of = [](int i) { return format("value{:05}", i) + string(64, 'v'); };
+    Params params{.verify_checksums = true, .ordered_index = true};
+    {
+        BitCask bc(test_dir_, with_backend(params));
+        for (int i = 0; i < kCount; i++) {
+            ASSERT_EQ(bc.put(key_of(i), value_of(i)).get(), true);
+        }
+    }
+    for (auto& entry : filesystem::directory_iterator(test_dir_)) {
+        if (entry.path().extension() != ".data") {
+            continue;
+        }
+        ifstream in(entry.path(), ios::binary);
+        string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        fstream file(entry.path(), ios::in | ios::out | ios::binary);
+        for (int i = 10; i < 30; i++) {
+            auto pos = data.find(value_of(i));
+            ASSERT_NE(pos, string::npos);
+            file.seekp(pos);
+            file.put('V');
+        }
+    }
+
+    BitCask bc(test_dir_, with_backend(params));
+    auto page = bc.scan("", "", 20);
+    ASSERT_EQ(page.size(), 20);
+    for (int i = 0; i < 20; i++) {
+        auto index = i < 10 ? i : i + 20;
+        ASSERT_EQ(page[i], make_pair(key_of(index), value_of(index)));
+    }
+    ASSERT_EQ(bc.scan(key_of(5), "", 10).back().first, key_of(34));
+    ASSERT_EQ(bc.prefix_scan("key", 0).size(), kCount - 20);
+    ASSERT_EQ(bc.scan(key_of(10), key_of(30), 5).size(), 0);
+}
+
+TEST_P(BitCaskTest, fold_test) {
+    int count = FLAGS_num_kvs;
+    map<string, string> kvs;
+    auto fold_all = [&](BitCask& bc, const function<void()>& on_first = nullptr) {
+        map<string, string> folded;
+        ASSERT_TRUE(bc.fold([&](string_view key, string_view value) {
+            if (folded.empty() && on_first) on_first();
+            EXPECT_TRUE(folded.emplace(key, value).second);
+            return true;
+        }));
+        ASSERT_EQ(folded, kvs);
+    };
+    auto data_files = [&]() {
+        set<string> files;
+        for (auto& entry : filesystem::directory_iterator(test_dir_)) {
+            if (entry.path().extension() == ".data") {
+                files.insert(entry.path().filename().string());
+            }
+        }
+        return files;
+    };
+
+    Params params{.max_data_file_size = 64 * 1024, .compression = Compression::kLZ4};
+    {
+        BitCask bc(test_dir_, with_backend(params));
+        for (int round = 0; round < 3; round++) {
+            for (int i = 0; i < count; i++) {
+                auto key = "key" + to_string(i);
+                kvs[key] = to_string(round) + string(100 + i % 200, 'a' + i % 26);
+                ASSERT_EQ(bc.put(key, kvs[key]).get(), true);
+            }
+        }
+        for (int i = 0; i < count; i += 4) {
+            kvs.erase("key" + to_string(i));
+            ASSERT_EQ(bc.remove("key" + to_string(i)).get(), true);
+        }
+        fold_all(bc);
+
+        // Stopping early.
+        int seen = 0;
+        ASSERT_TRUE(bc.fold([&](string_view, string_view) { return ++seen < 10; }));
+        ASSERT_EQ(seen, 10);
+    }
+
+    // Compaction waits for the fold to be done with the files, so no merge
+    // output shows up until then. Compaction also runs once at open and may
+    // merge before the fold pins the files, and its inputs are unlinked
+    // later, so files may still go away meanwhile.
+    params.compaction_interval_secs = 1;
+    BitCask bc(test_dir_, with_backend(params));
+    auto new_files = [&](const set<string>& before) {
+        set<string> files;
+        for (auto& file : data_files()) {
+            if (!before.count(file)) files.insert(file);
+        }
+        return files;
+    };
+    set<string> files;
+    fold_all(bc, [&]() {
+        files = data_files();
+        ASSERT_TRUE(wait_for_compaction(bc));
+        ASSERT_TRUE(new_files(files).empty());
+    });
+    ASSERT_TRUE(eventually([&]() { return !new_files(files).empty(); }));
+    fold_all(bc);
+}
+
+TEST_P(BitCaskTest, stats_test) {
+    int count = FLAGS_num_kvs;
+    auto kvs = generate_random_kvs(count);
+    {
+        BitCask bc(test_dir_,
+                   with_backend(Params{.max_data_file_size = 64 * 1024, .value_cache_bytes = 64 * 1024 * 1024}));
+        for (auto& [key, value] : kvs) {
+            ASSERT_EQ(bc.put(key, value).get(), true);
+        }
+        // The first read comes from the active file, the second from the cache.
+        for (int round = 0; round < 2; round++) {
+            for (auto& [key, value] : kvs) {
+                ASSERT_EQ(bc.get(key).value(), value);
+            }
+        }
+        ASSERT_EQ(bc.get("missing").has_value(), false);
+
+        auto stats = bc.stats();
+        ASSERT_EQ(stats.put_latency_nsecs.count, count);
+        ASSERT_GT(stats.put_latency_nsecs.p50, 0);
+        ASSERT_LE(stats.put_latency_nsecs.p50, stats.put_latency_nsecs.p99);
+        ASSERT_LE(stats.put_latency_nsecs.p999, stats.put_latency_nsecs.max);
+        ASSERT_EQ(stats.flush_batch_records.sum, count);
+        ASSERT_EQ(stats.flush_batch_records.count, stats.write_records_nsecs.count);
+        ASSERT_EQ(stats.get_pread_nsecs.count, count);
+        ASSERT_EQ(stats.get_cache_nsecs.count, count);
+        ASSERT_EQ(stats.get_mmap_nsecs.count, 0);
+        ASSERT_EQ(stats.get_misses, 1);
+        ASSERT_EQ(stats.keys, count);
+        ASSERT_GT(stats.key_dir_bytes, 0);
+        ASSERT_EQ(stats.cache.hits, count);
+        ASSERT_GT(stats.data_files.size(), 1);
+        ASSERT_TRUE(is_sorted(stats.data_files.begin(), stats.data_files.end(),
+                              [](const auto& a, const auto& b) { return a.file_id < b.file_id; }));
+
+        // Leave a quarter of the keys live.
+        for (int i = 0; i < kvs.size(); i++) {
+            if (i % 4) {
+                ASSERT_EQ(bc.remove(kvs[i].first).get(), true);
+            }
+        }
+        stats = bc.stats();
+        ASSERT_EQ(stats.keys, (count + 3) / 4);
+        ASSERT_GT(stats.data_files.front().dead_ratio, 0.5);
+    }
+
+    // The exporter sees compaction reclaim the dead records.
+    mutex mu;
+    condition_variable cv;
+    optional<Stats> exported;
+    Params params{.max_data_file_size = 64 * 1024, .compaction_interval_secs = 1};
+    params.stats_export_interval_secs = 1;
+    params.stats_exporter = [&](const Stats& stats) {
+        lock_guard lock(mu);
+        exported = stats;
+        cv.notify_all();
+    };
+    BitCask bc(test_dir_, with_backend(params));
+    unique_lock lock(mu);
+    ASSERT_TRUE(cv.wait_for(lock, chrono::seconds(10), [&] { return exported && exported->merges > 0; }));
+    ASSERT_GT(exported->compaction_bytes_read, 0);
+    ASSERT_GT(exported->compaction_bytes_written, 0);
+    ASSERT_GT(exported->compaction_bytes_reclaimed, 0);
+}
+
+TEST_P(BitCaskTest, get_async_test) {
+    int count = FLAGS_num_kvs;
+    auto kvs = generate_random_kvs(count);
+    for (uint64_t threads : {0, 1, 8}) {
+        BitCask bc(test_dir_, with_backend(Params{.max_data_file_size = 64 * 1024, .async_read_threads = threads}));
+        if (threads == 0) {
+            for (auto& [key, value] : kvs) {
+                ASSERT_EQ(bc.put(key, value).get(), true);
+            }
+        }
+        // Keep every read in flight at once.
+        vector<folly::SemiFuture<optional<string>>> futures;
+        for (auto& [key, value] : kvs) {
+            futures.emplace_back(bc.get_async(key));
+        }
+        futures.emplace_back(bc.get_async("missing"));
+        for (int i = 0; i < kvs.size(); i++) {
+            ASSERT_EQ(std::move(futures[i]).get().value(), kvs[i].second);
+        }
+        ASSERT_EQ(std::move(futures.back()).get().has_value(), false);
+    }
+
+    // Reads beyond the pending limit fail instead of queueing up. The only
+    // thread of the executor is held up, so the first read stays pending.
+    auto executor = make_shared<folly::CPUThreadPoolExecutor>(1);
+    promise<void> release;
+    executor->add([released = release.get_future()]() mutable { released.wait(); });
+    {
+        BitCask bc(test_dir_, with_backend(Params{.max_pending_async_reads = 1, .async_read_executor = executor}));
+        auto first = bc.get_async(kvs[0].first);
+        for (int i = 1; i < kvs.size(); i++) {
+            ASSERT_THROW(bc.get_async(kvs[i].first).get(), runtime_error);
+        }
+        ASSERT_FALSE(first.isReady());
+        release.set_value();
+        ASSERT_EQ(std::move(first).get().value(), kvs[0].second);
+        ASSERT_EQ(bc.get_async(kvs[1].first).get().value(), kvs[1].second);
+    }
+
+    // Closing the store waits for the reads it still has on the executor.
+    promise<void> hold;
+    executor->add([held = hold.get_future()]() mutable { held.wait(); });
+    folly::SemiFuture<optional<string>> last = folly::makeSemiFuture(optional<string>());
+    thread releaser([&]() {
+        this_thread::sleep_for(chrono::milliseconds(100));
+        hold.set_value();
+    });
+    {
+        BitCask bc(test_dir_, with_backend(Params{.async_read_executor = executor}));
+        last = bc.get_async(kvs[0].first);
+    }
+    EXPECT_TRUE(last.isReady());
+    releaser.join();
+    ASSERT_EQ(std::move(last).get().value(), kvs[0].second);
+}
+
 int main(int argc, char** argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
-}
\ No newline at end of file
+}
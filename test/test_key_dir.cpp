@@ -0,0 +1,99 @@
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include "key_dir.hpp"
+
+using namespace std;
+using namespace bitcask;
+
+namespace {
+KeyDirEntry make_entry(uint64_t i) {
+    return KeyDirEntry{.file_id = i % 1000, .value_size = i, .value_offset = i * 16, .tstamp = i, .codec = 1};
+}
+}  // namespace
+
+TEST(KeyDirTest, rehash_test) {
+    constexpr uint64_t kCount = 100000;
+    KeyDir key_dir;
+    for (uint64_t i = 0; i < kCount; i++) {
+        ASSERT_FALSE(key_dir.insert("key" + to_string(i), make_entry(i)).has_value());
+    }
+    ASSERT_EQ(key_dir.size(), kCount);
+    for (uint64_t i = 0; i < kCount; i++) {
+        auto entry = key_dir.get("key" + to_string(i));
+        ASSERT_TRUE(entry.has_value());
+        ASSERT_EQ(entry->value_offset, i * 16);
+        ASSERT_EQ(entry->value_size, i);
+        ASSERT_EQ(entry->codec, 1);
+    }
+    ASSERT_FALSE(key_dir.get("missing").has_value());
+
+    // Entries at the limits of the packed fields come back intact.
+    KeyDirEntry largest{.file_id = UINT32_MAX,
+                        .value_size = kMaxValueSize,
+                        .value_offset = UINT64_MAX,
+                        .tstamp = (1ULL << 56) - 1,
+                        .codec = 3};
+    auto previous = key_dir.insert("key0", largest);
+    ASSERT_EQ(previous->value_offset, 0);
+    auto entry = key_dir.get("key0").value();
+    ASSERT_EQ(entry.file_id, largest.file_id);
+    ASSERT_EQ(entry.value_size, largest.value_size);
+    ASSERT_EQ(entry.value_offset, largest.value_offset);
+    ASSERT_EQ(entry.tstamp, largest.tstamp);
+    ASSERT_EQ(entry.codec, largest.codec);
+}
+
+TEST(KeyDirTest, deleted_slot_reuse_test) {
+    constexpr uint64_t kCount = 10000;
+    KeyDir key_dir;
+    for (uint64_t i = 0; i < kCount; i++) {
+        key_dir.insert("key" + to_string(i), make_entry(i));
+    }
+    auto memory = key_dir.memory_usage();
+
+    // Removing and adding back the same keys reuses their slots and the
+    // table never grows.
+    for (int round = 0; round < 20; round++) {
+        for (uint64_t i = 0; i < kCount; i++) {
+            ASSERT_EQ(key_dir.remove("key" + to_string(i))->value_size, i);
+        }
+        ASSERT_EQ(key_dir.size(), 0);
+        ASSERT_FALSE(key_dir.get("key0").has_value());
+        for (uint64_t i = 0; i < kCount; i++) {
+            ASSERT_FALSE(key_dir.insert("key" + to_string(i), make_entry(i)).has_value());
+        }
+        ASSERT_EQ(key_dir.size(), kCount);
+    }
+    ASSERT_LE(key_dir.memory_usage(), memory * 2);
+}
+
+TEST(KeyDirTest, arena_compaction_test) {
+    constexpr uint64_t kCount = 10000;
+    KeyDir key_dir;
+    uint64_t memory = 0;
+    // Every round leaves only dead keys behind in the arenas, which rehashes
+    // copy out of the way instead of growing them.
+    for (uint64_t round = 0; round < 50; round++) {
+        auto prefix = "round" + to_string(round) + "-";
+        for (uint64_t i = 0; i < kCount; i++) {
+            key_dir.insert(prefix + to_string(i), make_entry(i));
+        }
+        for (uint64_t i = 0; i < kCount; i += 2) {
+            key_dir.remove(prefix + to_string(i));
+        }
+        // Updates are checked against the location they expect.
+        ASSERT_FALSE(key_dir.update_if(prefix + "1", make_entry(2), make_entry(3)));
+        ASSERT_TRUE(key_dir.update_if(prefix + "1", make_entry(1), make_entry(3)));
+        ASSERT_EQ(key_dir.get(prefix + "1")->value_size, 3);
+        for (uint64_t i = 1; i < kCount; i += 2) {
+            key_dir.remove(prefix + to_string(i));
+        }
+        ASSERT_EQ(key_dir.size(), 0);
+        if (round == 0) {
+            memory = key_dir.memory_usage();
+        }
+    }
+    ASSERT_LE(key_dir.memory_usage(), memory * 2);
+}